@@ -0,0 +1,370 @@
+//
+//  analysis.c
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "analysis.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define MIN_SEGMENT                 64
+#define BASELINE_WINDOW             120
+#define DESATURATION_DROP           3
+#define DESATURATION_DURATION       10
+#define CYCLE_MIN                   20
+#define CYCLE_MAX                   120
+#define CYCLE_RUN                   3
+
+#define VALID(recording, i)         ((recording)->spo2[i] != 0 && (recording)->bpm[i] != 0)
+
+/* radix-2 FFT of a real sequence of length n, computed as a complex FFT of length n / 2 */
+struct fft {
+    unsigned n;
+    double *cos_table;              /* cos(2 pi k / n), k < n / 2 */
+    double *sin_table;
+    unsigned *reverse;              /* bit reversed indices for n / 2 */
+    double *re;
+    double *im;
+};
+
+/* running sums of one variability window, integers so that sliding never drifts */
+struct running {
+    uint64_t count;
+    uint64_t sum_bpm;
+    uint64_t sum2_bpm;
+    uint64_t sum_spo2;
+    uint64_t sum2_spo2;
+    uint64_t diffs;
+    uint64_t diff2_bpm;
+};
+
+static void fft_free(struct fft *fft)
+{
+    free(fft->cos_table);
+    free(fft->sin_table);
+    free(fft->reverse);
+    free(fft->re);
+    free(fft->im);
+}
+
+static int fft_init(struct fft *fft, unsigned n)
+{
+    unsigned m = n / 2;
+    fft->n = n;
+    fft->cos_table = malloc(m * sizeof(double));
+    fft->sin_table = malloc(m * sizeof(double));
+    fft->reverse = malloc(m * sizeof(unsigned));
+    fft->re = malloc(m * sizeof(double));
+    fft->im = malloc(m * sizeof(double));
+    if (!fft->cos_table || !fft->sin_table || !fft->reverse || !fft->re || !fft->im) {
+        fft_free(fft);
+        return -1;
+    }
+
+    for (unsigned k = 0; k < m; ++k) {
+        fft->cos_table[k] = cos(2 * M_PI * k / n);
+        fft->sin_table[k] = sin(2 * M_PI * k / n);
+    }
+
+    unsigned bits = 0;
+    while ((1u << bits) < m) ++bits;
+    for (unsigned i = 0; i < m; ++i) {
+        unsigned r = 0;
+        for (unsigned b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits - 1 - b);
+        fft->reverse[i] = r;
+    }
+
+    return 0;
+}
+
+static void fft_complex(struct fft *fft)
+{
+    unsigned m = fft->n / 2;
+    double *re = fft->re, *im = fft->im;
+
+    for (unsigned i = 0; i < m; ++i) {
+        unsigned j = fft->reverse[i];
+        if (j > i) {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (unsigned size = 2; size <= m; size *= 2) {
+        unsigned half = size / 2, stride = fft->n / size;
+        for (unsigned i = 0; i < m; i += size) {
+            for (unsigned j = 0; j < half; ++j) {
+                double wr = fft->cos_table[j * stride], wi = -fft->sin_table[j * stride];
+                unsigned a = i + j, b = a + half;
+                double tr = wr * re[b] - wi * im[b];
+                double ti = wr * im[b] + wi * re[b];
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+/* adds |X[k]|^2 of the real sequence x to power[k] for k = 0 ... n / 2 */
+static void fft_power(struct fft *fft, const double *x, double *power)
+{
+    unsigned m = fft->n / 2;
+    for (unsigned k = 0; k < m; ++k) {
+        fft->re[k] = x[2 * k];
+        fft->im[k] = x[2 * k + 1];
+    }
+    fft_complex(fft);
+
+    for (unsigned k = 0; k <= m; ++k) {
+        unsigned a = k % m, b = (m - k) % m;
+        /* split Z into the spectra of the even and the odd samples */
+        double even_re = (fft->re[a] + fft->re[b]) / 2, even_im = (fft->im[a] - fft->im[b]) / 2;
+        double odd_re = (fft->im[a] + fft->im[b]) / 2, odd_im = -(fft->re[a] - fft->re[b]) / 2;
+        double wr = k < m ? fft->cos_table[k] : -1, wi = k < m ? -fft->sin_table[k] : 0;
+        double xr = even_re + wr * odd_re - wi * odd_im;
+        double xi = even_im + wr * odd_im + wi * odd_re;
+        power[k] += xr * xr + xi * xi;
+    }
+}
+
+/* samples without signal repeat the last valid value so that gaps do not show up as broadband power */
+static double *fill_gaps(const unsigned char *values, unsigned length)
+{
+    double *filled = malloc(length * sizeof(double));
+    if (!filled) return NULL;
+
+    unsigned first = 0;
+    while (first < length && values[first] == 0) ++first;
+    double last = first < length ? values[first] : 0;
+    for (unsigned i = 0; i < length; ++i) {
+        if (values[i]) last = values[i];
+        filled[i] = last;
+    }
+
+    return filled;
+}
+
+/* Welch estimate, the prefix sums give the mean of every overlapping segment in constant time */
+static int welch(struct fft *fft, const double *window, double window_power, const double *x, unsigned length, double *power)
+{
+    unsigned n = fft->n;
+    double *prefix = malloc((length + 1) * sizeof(double));
+    double *segment = malloc(n * sizeof(double));
+    if (!prefix || !segment) { free(prefix); free(segment); return -1; }
+
+    prefix[0] = 0;
+    for (unsigned i = 0; i < length; ++i) prefix[i + 1] = prefix[i] + x[i];
+
+    unsigned segments = 0;
+    for (unsigned start = 0; start + n <= length; start += n / 2) {
+        double mean = (prefix[start + n] - prefix[start]) / n;
+        for (unsigned i = 0; i < n; ++i) segment[i] = (x[start + i] - mean) * window[i];
+        fft_power(fft, segment, power);
+        ++segments;
+    }
+
+    for (unsigned k = 0; k <= n / 2; ++k) {
+        power[k] /= segments * window_power;
+        if (k != 0 && k != n / 2) power[k] *= 2;
+    }
+
+    free(prefix);
+    free(segment);
+    return 0;
+}
+
+static cms50f_status_t spectrum(const cms50f_recording_t *recording, cms50f_analysis_t *analysis)
+{
+    unsigned n = CMS50F_ANALYSIS_SEGMENT;
+    while (n > recording->length && n > MIN_SEGMENT) n /= 2;
+    if (n > recording->length) return CMS50F_SUCCESS;
+
+    struct fft fft = {0};
+    if (fft_init(&fft, n) < 0) return CMS50F_ENOMEM;
+
+    cms50f_status_t status = CMS50F_ENOMEM;
+    double *window = malloc(n * sizeof(double));
+    double *spo2 = fill_gaps(recording->spo2, recording->length);
+    double *bpm = fill_gaps(recording->bpm, recording->length);
+    analysis->bins = n / 2 + 1;
+    analysis->resolution = 1.0 / n;
+    analysis->spo2_power = calloc(analysis->bins, sizeof(double));
+    analysis->bpm_power = calloc(analysis->bins, sizeof(double));
+
+    if (window && spo2 && bpm && analysis->spo2_power && analysis->bpm_power) {
+        double window_power = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            window[i] = 0.5 * (1 - cos(2 * M_PI * i / n));
+            window_power += window[i] * window[i];
+        }
+        if (welch(&fft, window, window_power, spo2, recording->length, analysis->spo2_power) == 0
+            && welch(&fft, window, window_power, bpm, recording->length, analysis->bpm_power) == 0)
+            status = CMS50F_SUCCESS;
+    }
+
+    if (status == CMS50F_SUCCESS) {
+        double total = 0, band = 0, peak = 0;
+        for (unsigned k = 1; k < analysis->bins; ++k) {
+            double power = analysis->spo2_power[k];
+            double frequency = k * analysis->resolution;
+            total += power;
+            if (frequency < 1.0 / CYCLE_MAX || frequency > 1.0 / CYCLE_MIN) continue;
+            band += power;
+            if (power > peak) { peak = power; analysis->cycle_period = 1 / frequency; }
+        }
+        analysis->cycle_power = total > 0 ? band / total : 0;
+    }
+
+    free(window);
+    free(spo2);
+    free(bpm);
+    fft_free(&fft);
+    return status;
+}
+
+static void running_add(struct running *running, const cms50f_recording_t *recording, unsigned i, unsigned lo)
+{
+    if (!VALID(recording, i)) return;
+    unsigned spo2 = recording->spo2[i], bpm = recording->bpm[i];
+    ++running->count;
+    running->sum_bpm += bpm;
+    running->sum2_bpm += bpm * bpm;
+    running->sum_spo2 += spo2;
+    running->sum2_spo2 += spo2 * spo2;
+    if (i > lo && VALID(recording, i - 1)) {
+        int diff = (int)bpm - recording->bpm[i - 1];
+        ++running->diffs;
+        running->diff2_bpm += diff * diff;
+    }
+}
+
+static void running_remove(struct running *running, const cms50f_recording_t *recording, unsigned lo, unsigned hi)
+{
+    if (!VALID(recording, lo)) return;
+    unsigned spo2 = recording->spo2[lo], bpm = recording->bpm[lo];
+    --running->count;
+    running->sum_bpm -= bpm;
+    running->sum2_bpm -= bpm * bpm;
+    running->sum_spo2 -= spo2;
+    running->sum2_spo2 -= spo2 * spo2;
+    if (lo + 1 < hi && VALID(recording, lo + 1)) {
+        int diff = (int)recording->bpm[lo + 1] - bpm;
+        --running->diffs;
+        running->diff2_bpm -= diff * diff;
+    }
+}
+
+static double deviation(uint64_t count, uint64_t sum, uint64_t sum2)
+{
+    if (count < 2) return 0;
+    double variance = (sum2 - (double)sum * sum / count) / (count - 1);
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+/* every window is derived from the previous one by adding and removing CMS50F_ANALYSIS_STEP seconds */
+static cms50f_status_t variability(const cms50f_recording_t *recording, cms50f_analysis_t *analysis)
+{
+    unsigned length = recording->length;
+    if (length == 0) return CMS50F_SUCCESS;
+
+    analysis->window_count = length <= CMS50F_ANALYSIS_WINDOW ? 1 : (length - CMS50F_ANALYSIS_WINDOW) / CMS50F_ANALYSIS_STEP + 1;
+    analysis->windows = calloc(analysis->window_count, sizeof(cms50f_variability_t));
+    if (!analysis->windows) return CMS50F_ENOMEM;
+
+    struct running running = {0};
+    unsigned lo = 0, hi = 0;
+    for (unsigned w = 0; w < analysis->window_count; ++w) {
+        unsigned start = w * CMS50F_ANALYSIS_STEP;
+        unsigned end = start + CMS50F_ANALYSIS_WINDOW < length ? start + CMS50F_ANALYSIS_WINDOW : length;
+        for (; lo < start; ++lo) running_remove(&running, recording, lo, hi);
+        for (; hi < end; ++hi) running_add(&running, recording, hi, lo);
+
+        cms50f_variability_t *window = &analysis->windows[w];
+        window->start = recording->start + start;
+        window->valid = (unsigned)running.count;
+        if (running.count == 0) continue;
+        window->mean_bpm = (double)running.sum_bpm / running.count;
+        window->sd_bpm = deviation(running.count, running.sum_bpm, running.sum2_bpm);
+        window->rmssd_bpm = running.diffs ? sqrt((double)running.diff2_bpm / running.diffs) : 0;
+        window->mean_spo2 = (double)running.sum_spo2 / running.count;
+        window->sd_spo2 = deviation(running.count, running.sum_spo2, running.sum2_spo2);
+    }
+
+    return CMS50F_SUCCESS;
+}
+
+/* baseline is the highest saturation of the preceding two minutes, kept in a monotonic queue */
+static cms50f_status_t desaturations(const cms50f_recording_t *recording, cms50f_analysis_t *analysis)
+{
+    unsigned length = recording->length;
+    unsigned *queue = malloc((length + 1) * sizeof(unsigned));
+    unsigned *events = malloc((length / DESATURATION_DURATION + 1) * sizeof(unsigned));
+    if (!queue || !events) { free(queue); free(events); return CMS50F_ENOMEM; }
+
+    unsigned head = 0, tail = 0, event_count = 0, valid = 0;
+    unsigned event_start = 0, event_baseline = 0;
+    int in_event = 0;
+    for (unsigned i = 0; i < length; ++i) {
+        unsigned spo2 = recording->spo2[i];
+        while (head < tail && queue[head] + BASELINE_WINDOW < i) ++head;
+        if (spo2 == 0) continue;
+        ++valid;
+
+        unsigned baseline = head < tail ? recording->spo2[queue[head]] : 0;
+        if (!in_event && spo2 + DESATURATION_DROP <= baseline) {
+            in_event = 1;
+            event_start = i;
+            event_baseline = baseline;
+        } else if (in_event && spo2 + DESATURATION_DROP > event_baseline) {
+            in_event = 0;
+            if (i - event_start >= DESATURATION_DURATION) events[event_count++] = event_start;
+        }
+
+        while (tail > head && recording->spo2[queue[tail - 1]] <= spo2) --tail;
+        queue[tail++] = i;
+    }
+
+    analysis->desaturations = event_count;
+    analysis->desaturation_index = valid ? event_count * 3600.0 / valid : 0;
+
+    unsigned run = 1;
+    for (unsigned e = 1; e <= event_count; ++e) {
+        unsigned interval = e < event_count ? events[e] - events[e - 1] : 0;
+        if (interval >= CYCLE_MIN && interval <= CYCLE_MAX) { ++run; continue; }
+        if (run >= CYCLE_RUN) analysis->periodic_desaturations += run;
+        run = 1;
+    }
+
+    free(queue);
+    free(events);
+    return CMS50F_SUCCESS;
+}
+
+cms50f_status_t cms50f_analysis_run(const cms50f_recording_t *recording, cms50f_analysis_t *analysis)
+{
+    if (!recording || !analysis) return CMS50F_EINVAL;
+    memset(analysis, 0, sizeof(*analysis));
+
+    cms50f_status_t status = variability(recording, analysis);
+    if (status == CMS50F_SUCCESS) status = spectrum(recording, analysis);
+    if (status == CMS50F_SUCCESS) status = desaturations(recording, analysis);
+    if (status != CMS50F_SUCCESS) cms50f_analysis_free(analysis);
+
+    return status;
+}
+
+void cms50f_analysis_free(cms50f_analysis_t *analysis)
+{
+    if (!analysis) return;
+    free(analysis->windows);
+    free(analysis->spo2_power);
+    free(analysis->bpm_power);
+    memset(analysis, 0, sizeof(*analysis));
+}
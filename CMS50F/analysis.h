@@ -0,0 +1,49 @@
+//
+//  analysis.h
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef analysis_h
+#define analysis_h
+
+#include "recording.h"
+
+#define CMS50F_ANALYSIS_WINDOW      300     /* seconds per variability window */
+#define CMS50F_ANALYSIS_STEP        30      /* seconds between two windows */
+#define CMS50F_ANALYSIS_SEGMENT     1024    /* samples per spectrum segment, a power of two */
+
+/* pulse rate and saturation variability of one window, samples without signal are skipped */
+typedef struct {
+    time_t start;
+    unsigned valid;
+    double mean_bpm;
+    double sd_bpm;
+    double rmssd_bpm;               /* root mean square of successive differences */
+    double mean_spo2;
+    double sd_spo2;
+} cms50f_variability_t;
+
+typedef struct {
+    unsigned window_count;
+    cms50f_variability_t *windows;
+
+    /* Welch power spectral density (Hann window, 50% overlap) at 1 Hz sampling */
+    unsigned bins;
+    double resolution;              /* Hz per bin */
+    double *spo2_power;
+    double *bpm_power;
+
+    /* desaturations of at least 3% below the 2 minute baseline lasting 10 seconds */
+    unsigned desaturations;
+    double desaturation_index;      /* per hour of valid signal */
+    unsigned periodic_desaturations; /* part of a run of at least 3 events 20 to 120 seconds apart */
+    double cycle_period;            /* strongest SpO2 period between 20 and 120 seconds, 0 without spectrum */
+    double cycle_power;             /* fraction of the SpO2 power in that band */
+} cms50f_analysis_t;
+
+cms50f_status_t cms50f_analysis_run(const cms50f_recording_t *recording, cms50f_analysis_t *analysis);
+void cms50f_analysis_free(cms50f_analysis_t *analysis);
+
+#endif /* analysis_h */
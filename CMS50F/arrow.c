@@ -0,0 +1,434 @@
+//
+//  arrow.c
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "arrow.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define ARROW_MAGIC                 "ARROW1"
+#define ARROW_ALIGNMENT             64
+#define ARROW_CONTINUATION          0xffffffff
+#define ARROW_METADATA_V5           4
+
+#define FB_DEFAULT                  { 0, 0 }
+#define FB_OFFSET                   { 4, 0 }
+
+enum message_header {
+    HEADER_SCHEMA                   = 1,
+    HEADER_RECORD_BATCH             = 3,
+};
+
+enum column_type {
+    TYPE_INT                        = 2,
+    TYPE_TIMESTAMP                  = 10,
+};
+
+enum column {
+    COLUMN_NIGHT,
+    COLUMN_TIMESTAMP,
+    COLUMN_SPO2,
+    COLUMN_BPM,
+    COLUMN_COUNT
+};
+
+static const struct {
+    const char *name;
+    enum column_type type;
+    int bit_width;
+} column_list[] = {
+    { "night",      TYPE_INT,       32  },
+    { "timestamp",  TYPE_TIMESTAMP, 64  },
+    { "spo2",       TYPE_INT,       8   },
+    { "bpm",        TYPE_INT,       8   },
+};
+
+struct block {
+    int64_t offset;
+    int32_t metadata_length;
+    int64_t body_length;
+};
+
+struct cms50f_arrow_writer_instance_t {
+    FILE *out;
+    int64_t position;
+    int first_column;
+    int failed;
+
+    uint32_t night;
+    size_t length;
+    size_t capacity;
+    uint32_t *nights;
+    int64_t *timestamps;
+    uint8_t *spo2;
+    uint8_t *bpm;
+
+    struct block *blocks;
+    size_t block_count;
+    size_t block_capacity;
+};
+
+/*
+ * The metadata is encoded as flatbuffers. Instead of pulling in the flatbuffers
+ * runtime the tables are written front to back: a table is emitted with
+ * placeholders for its offset fields and the children are linked in as soon as
+ * they are written behind it.
+ */
+struct flatbuffer {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+};
+
+struct fb_field {
+    int size;                       /* 0 leaves the field at its default */
+    uint64_t value;
+};
+
+static void fb_grow(struct flatbuffer *fb, size_t n)
+{
+    if (fb->failed || fb->length + n <= fb->capacity) return;
+    size_t capacity = fb->capacity ? fb->capacity : 256;
+    while (capacity < fb->length + n) capacity *= 2;
+    unsigned char *data = realloc(fb->data, capacity);
+    if (!data) { fb->failed = 1; return; }
+    fb->data = data;
+    fb->capacity = capacity;
+}
+
+static void fb_scalar(struct flatbuffer *fb, uint64_t value, int size)
+{
+    fb_grow(fb, size);
+    if (fb->failed) return;
+    for (int i = 0; i < size; ++i) fb->data[fb->length++] = (value >> (8 * i)) & 0xff;
+}
+
+static void fb_patch(struct flatbuffer *fb, size_t at, uint64_t value, int size)
+{
+    if (fb->failed) return;
+    for (int i = 0; i < size; ++i) fb->data[at + i] = (value >> (8 * i)) & 0xff;
+}
+
+static void fb_align(struct flatbuffer *fb, size_t alignment, size_t additional)
+{
+    while (!fb->failed && (fb->length + additional) % alignment) fb_scalar(fb, 0, 1);
+}
+
+static void fb_link(struct flatbuffer *fb, size_t at, size_t target)
+{
+    fb_patch(fb, at, target - at, 4);
+}
+
+static size_t fb_table(struct flatbuffer *fb, const struct fb_field *fields, int n, size_t *position)
+{
+    fb_align(fb, 2, 0);
+    size_t vtable = fb->length;
+    for (int i = 0; i < n + 2; ++i) fb_scalar(fb, 0, 2);
+
+    fb_align(fb, 4, 0);
+    size_t table = fb->length;
+    fb_scalar(fb, table - vtable, 4);
+    for (int i = 0; i < n; ++i) {
+        position[i] = 0;
+        if (fields[i].size == 0) continue;
+        fb_align(fb, fields[i].size, 0);
+        position[i] = fb->length;
+        fb_patch(fb, vtable + 4 + 2 * i, fb->length - table, 2);
+        fb_scalar(fb, fields[i].value, fields[i].size);
+    }
+    fb_patch(fb, vtable, 4 + 2 * n, 2);
+    fb_patch(fb, vtable + 2, fb->length - table, 2);
+
+    return table;
+}
+
+static size_t fb_string(struct flatbuffer *fb, const char *string)
+{
+    size_t length = strlen(string);
+    fb_align(fb, 4, 0);
+    size_t position = fb->length;
+    fb_scalar(fb, length, 4);
+    for (size_t i = 0; i <= length; ++i) fb_scalar(fb, (unsigned char)string[i], 1);
+    return position;
+}
+
+static size_t fb_vector(struct flatbuffer *fb, size_t count, size_t alignment)
+{
+    fb_align(fb, alignment < 4 ? 4 : alignment, 4);
+    size_t position = fb->length;
+    fb_scalar(fb, count, 4);
+    return position;
+}
+
+static void fb_message(struct flatbuffer *fb, enum message_header header_type, int64_t body_length, size_t *header)
+{
+    fb_scalar(fb, 0, 4);
+
+    size_t position[4];
+    const struct fb_field message[] = {
+        { 2, ARROW_METADATA_V5 }, { 1, header_type }, FB_OFFSET, { 8, body_length }
+    };
+    fb_link(fb, 0, fb_table(fb, message, 4, position));
+    *header = position[2];
+}
+
+static size_t fb_type(struct flatbuffer *fb, int column)
+{
+    size_t position[2];
+    if (column_list[column].type == TYPE_TIMESTAMP) {
+        const struct fb_field timestamp[] = { { 2, 0 /* seconds */ }, FB_OFFSET };
+        size_t table = fb_table(fb, timestamp, 2, position);
+        fb_link(fb, position[1], fb_string(fb, "UTC"));
+        return table;
+    }
+    const struct fb_field integer[] = { { 4, column_list[column].bit_width }, { 1, 0 /* unsigned */ } };
+    return fb_table(fb, integer, 2, position);
+}
+
+static size_t fb_schema(struct flatbuffer *fb, int first_column)
+{
+    size_t position[2];
+    const struct fb_field schema[] = { FB_DEFAULT /* little endian */, FB_OFFSET };
+    size_t table = fb_table(fb, schema, 2, position);
+
+    int count = COLUMN_COUNT - first_column;
+    size_t fields = fb_vector(fb, count, 4);
+    for (int i = 0; i < count; ++i) fb_scalar(fb, 0, 4);
+    fb_link(fb, position[1], fields);
+
+    for (int i = 0; i < count; ++i) {
+        int column = first_column + i;
+        size_t field_position[6];
+        const struct fb_field field[] = {
+            FB_OFFSET /* name */, FB_DEFAULT /* not nullable */, { 1, column_list[column].type },
+            FB_OFFSET /* type */, FB_DEFAULT /* no dictionary */, FB_OFFSET /* children */
+        };
+        fb_link(fb, fields + 4 + 4 * i, fb_table(fb, field, 6, field_position));
+        fb_link(fb, field_position[0], fb_string(fb, column_list[column].name));
+        fb_link(fb, field_position[3], fb_type(fb, column));
+        fb_link(fb, field_position[5], fb_vector(fb, 0, 4));
+    }
+
+    return table;
+}
+
+static void write_bytes(cms50f_arrow_writer_t writer, const void *data, size_t n)
+{
+    if (writer->failed) return;
+    if (fwrite(data, 1, n, writer->out) != n) {
+        LOG_DEBUG("could not write to arrow file: %s", strerror(errno));
+        writer->failed = 1;
+    }
+    writer->position += n;
+}
+
+static void write_padding(cms50f_arrow_writer_t writer, size_t alignment)
+{
+    static const unsigned char zeros[ARROW_ALIGNMENT] = {0};
+    size_t n = (alignment - writer->position % alignment) % alignment;
+    write_bytes(writer, zeros, n);
+}
+
+static void write_int32(cms50f_arrow_writer_t writer, uint32_t value)
+{
+    unsigned char buffer[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff };
+    write_bytes(writer, buffer, sizeof(buffer));
+}
+
+/* writes continuation marker, metadata size and the flatbuffer, padded so that the body starts 64 byte aligned */
+static cms50f_status_t write_message(cms50f_arrow_writer_t writer, struct flatbuffer *fb, int64_t body_length)
+{
+    if (fb->failed) { free(fb->data); return CMS50F_ENOMEM; }
+
+    int64_t offset = writer->position;
+    size_t padding = (ARROW_ALIGNMENT - (offset + 8 + fb->length) % ARROW_ALIGNMENT) % ARROW_ALIGNMENT;
+    int32_t metadata_size = (int32_t)(fb->length + padding);
+
+    write_int32(writer, ARROW_CONTINUATION);
+    write_int32(writer, metadata_size);
+    write_bytes(writer, fb->data, fb->length);
+    write_padding(writer, ARROW_ALIGNMENT);
+    free(fb->data);
+
+    if (body_length > 0) {
+        if (writer->block_count == writer->block_capacity) {
+            size_t capacity = writer->block_capacity ? writer->block_capacity * 2 : 16;
+            struct block *blocks = realloc(writer->blocks, capacity * sizeof(struct block));
+            if (!blocks) return CMS50F_ENOMEM;
+            writer->blocks = blocks;
+            writer->block_capacity = capacity;
+        }
+        writer->blocks[writer->block_count++] = (struct block){ offset, 8 + metadata_size, body_length };
+    }
+
+    return writer->failed ? CMS50F_EFILE : CMS50F_SUCCESS;
+}
+
+static cms50f_status_t write_record_batch(cms50f_arrow_writer_t writer)
+{
+    const void *columns[COLUMN_COUNT] = { writer->nights, writer->timestamps, writer->spo2, writer->bpm };
+    int64_t offsets[COLUMN_COUNT] = {0};
+    int64_t lengths[COLUMN_COUNT] = {0};
+    int64_t body_length = 0;
+    for (int column = writer->first_column; column < COLUMN_COUNT; ++column) {
+        offsets[column] = body_length;
+        lengths[column] = writer->length * column_list[column].bit_width / 8;
+        body_length += (lengths[column] + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    }
+
+    struct flatbuffer fb = {0};
+    size_t header, position[3];
+    fb_message(&fb, HEADER_RECORD_BATCH, body_length, &header);
+    const struct fb_field batch[] = { { 8, writer->length }, FB_OFFSET /* nodes */, FB_OFFSET /* buffers */ };
+    fb_link(&fb, header, fb_table(&fb, batch, 3, position));
+
+    int count = COLUMN_COUNT - writer->first_column;
+    fb_link(&fb, position[1], fb_vector(&fb, count, 8));
+    for (int column = writer->first_column; column < COLUMN_COUNT; ++column) {
+        fb_scalar(&fb, writer->length, 8);
+        fb_scalar(&fb, 0 /* null count */, 8);
+    }
+    fb_link(&fb, position[2], fb_vector(&fb, 2 * count, 8));
+    for (int column = writer->first_column; column < COLUMN_COUNT; ++column) {
+        fb_scalar(&fb, offsets[column], 8);     /* empty validity bitmap */
+        fb_scalar(&fb, 0, 8);
+        fb_scalar(&fb, offsets[column], 8);
+        fb_scalar(&fb, lengths[column], 8);
+    }
+
+    cms50f_status_t status = write_message(writer, &fb, body_length);
+    if (status != CMS50F_SUCCESS) return status;
+
+    /* arrow buffers are little endian, just like every host this runs on */
+    for (int column = writer->first_column; column < COLUMN_COUNT; ++column) {
+        write_bytes(writer, columns[column], lengths[column]);
+        write_padding(writer, ARROW_ALIGNMENT);
+    }
+
+    return writer->failed ? CMS50F_EFILE : CMS50F_SUCCESS;
+}
+
+static cms50f_status_t write_footer(cms50f_arrow_writer_t writer)
+{
+    write_int32(writer, ARROW_CONTINUATION);
+    write_int32(writer, 0);
+
+    struct flatbuffer fb = {0};
+    size_t position[4];
+    fb_scalar(&fb, 0, 4);
+    const struct fb_field footer[] = {
+        { 2, ARROW_METADATA_V5 }, FB_OFFSET /* schema */, FB_OFFSET /* dictionaries */, FB_OFFSET /* record batches */
+    };
+    fb_link(&fb, 0, fb_table(&fb, footer, 4, position));
+    fb_link(&fb, position[1], fb_schema(&fb, writer->first_column));
+    fb_link(&fb, position[2], fb_vector(&fb, 0, 8));
+    fb_link(&fb, position[3], fb_vector(&fb, writer->block_count, 8));
+    for (size_t i = 0; i < writer->block_count; ++i) {
+        fb_scalar(&fb, writer->blocks[i].offset, 8);
+        fb_scalar(&fb, writer->blocks[i].metadata_length, 4);
+        fb_scalar(&fb, 0, 4);
+        fb_scalar(&fb, writer->blocks[i].body_length, 8);
+    }
+    if (fb.failed) { free(fb.data); return CMS50F_ENOMEM; }
+
+    write_bytes(writer, fb.data, fb.length);
+    write_int32(writer, (uint32_t)fb.length);
+    write_bytes(writer, ARROW_MAGIC, strlen(ARROW_MAGIC));
+    free(fb.data);
+
+    return writer->failed ? CMS50F_EFILE : CMS50F_SUCCESS;
+}
+
+cms50f_arrow_writer_t cms50f_arrow_writer_open(const char *filename, int with_night)
+{
+    cms50f_arrow_writer_t writer = calloc(1, sizeof(struct cms50f_arrow_writer_instance_t));
+    if (!writer) return NULL;
+    writer->first_column = with_night ? COLUMN_NIGHT : COLUMN_TIMESTAMP;
+
+    if ((writer->out = fopen(filename, "wb")) == NULL) {
+        LOG_DEBUG("arrow file %s could not be opened: %s", filename, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    write_bytes(writer, ARROW_MAGIC "\0\0", strlen(ARROW_MAGIC) + 2);
+
+    struct flatbuffer fb = {0};
+    size_t header;
+    fb_message(&fb, HEADER_SCHEMA, 0, &header);
+    fb_link(&fb, header, fb_schema(&fb, writer->first_column));
+    if (write_message(writer, &fb, 0) != CMS50F_SUCCESS) {
+        fclose(writer->out);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+cms50f_status_t cms50f_arrow_writer_append(cms50f_arrow_writer_t writer, time_t timestamp, spo2_t spo2, bpm_t bpm)
+{
+    if (!writer) return CMS50F_EINVAL;
+
+    if (writer->length == writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity * 2 : 4096;
+        uint32_t *nights = realloc(writer->nights, capacity * sizeof(uint32_t));
+        if (nights) writer->nights = nights;
+        int64_t *timestamps = realloc(writer->timestamps, capacity * sizeof(int64_t));
+        if (timestamps) writer->timestamps = timestamps;
+        uint8_t *spo2_column = realloc(writer->spo2, capacity);
+        if (spo2_column) writer->spo2 = spo2_column;
+        uint8_t *bpm_column = realloc(writer->bpm, capacity);
+        if (bpm_column) writer->bpm = bpm_column;
+        if (!nights || !timestamps || !spo2_column || !bpm_column) return CMS50F_ENOMEM;
+        writer->capacity = capacity;
+    }
+
+    writer->nights[writer->length] = writer->night;
+    writer->timestamps[writer->length] = timestamp;
+    writer->spo2[writer->length] = spo2;
+    writer->bpm[writer->length] = bpm;
+    ++writer->length;
+
+    return CMS50F_SUCCESS;
+}
+
+cms50f_status_t cms50f_arrow_writer_end_night(cms50f_arrow_writer_t writer)
+{
+    if (!writer) return CMS50F_EINVAL;
+    if (writer->length == 0) return CMS50F_SUCCESS;
+
+    cms50f_status_t status = write_record_batch(writer);
+    writer->length = 0;
+    ++writer->night;
+
+    return status;
+}
+
+cms50f_status_t cms50f_arrow_writer_close(cms50f_arrow_writer_t *writer_ptr)
+{
+    if (!writer_ptr || !*writer_ptr) return CMS50F_EINVAL;
+    cms50f_arrow_writer_t writer = *writer_ptr;
+
+    cms50f_status_t status = cms50f_arrow_writer_end_night(writer);
+    if (status == CMS50F_SUCCESS) status = write_footer(writer);
+    if (fclose(writer->out) == EOF && status == CMS50F_SUCCESS) status = CMS50F_EFILE;
+
+    free(writer->nights);
+    free(writer->timestamps);
+    free(writer->spo2);
+    free(writer->bpm);
+    free(writer->blocks);
+    free(writer);
+    *writer_ptr = NULL;
+
+    return status;
+}
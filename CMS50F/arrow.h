@@ -0,0 +1,27 @@
+//
+//  arrow.h
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef arrow_h
+#define arrow_h
+
+#include "cms50f.h"
+
+/*
+ * Minimal writer for the Arrow IPC file format (Feather v2). The columns are
+ * timestamp (seconds, UTC), spo2 and bpm (uint8) and, for multi night tables,
+ * a leading night column (uint32). Every night is written as its own record
+ * batch, all buffers start on 64 byte boundaries so the file can be mapped.
+ */
+
+typedef struct cms50f_arrow_writer_instance_t *cms50f_arrow_writer_t;
+
+cms50f_arrow_writer_t cms50f_arrow_writer_open(const char *filename, int with_night);
+cms50f_status_t cms50f_arrow_writer_append(cms50f_arrow_writer_t writer, time_t timestamp, spo2_t spo2, bpm_t bpm);
+cms50f_status_t cms50f_arrow_writer_end_night(cms50f_arrow_writer_t writer);
+cms50f_status_t cms50f_arrow_writer_close(cms50f_arrow_writer_t *writer);
+
+#endif /* arrow_h */
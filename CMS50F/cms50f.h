@@ -19,6 +19,9 @@
 #define CMS50F_EWRITE               6
 #define CMS50F_EREAD                7
 #define CMS50F_EUNEXP               8
+#define CMS50F_EFILE                9
+#define CMS50F_ENOMEM               10
+#define CMS50F_EFORMAT              11
 
 #define CMS50F_ERROR_MSG_SIZE       80
 
@@ -40,6 +43,9 @@ static const struct {
     { CMS50F_EWRITE,    "error writing to device"                           },
     { CMS50F_EREAD,     "read from device failed"                           },
     { CMS50F_EUNEXP,    "unexpected answer from device, try reconnecting"   },
+    { CMS50F_EFILE,     "file could not be opened or written"               },
+    { CMS50F_ENOMEM,    "out of memory"                                     },
+    { CMS50F_EFORMAT,   "unexpected file format"                            },
 };
 
 const char * cms50f_strerror(cms50f_status_t statcode);
@@ -0,0 +1,145 @@
+//
+//  recording.c
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "recording.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static char *read_file(const char *filename, size_t *size)
+{
+    FILE *in = {0};
+    if ((in = fopen(filename, "r")) == NULL) {
+        LOG_DEBUG("file %s could not be opened: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    char *buffer = NULL;
+    long length = -1;
+    if (fseek(in, 0, SEEK_END) == 0 && (length = ftell(in)) >= 0 && fseek(in, 0, SEEK_SET) == 0
+        && (buffer = malloc(length + 1)) != NULL) {
+        *size = fread(buffer, 1, length, in);
+        buffer[*size] = '\0';
+    }
+    fclose(in);
+
+    return buffer;
+}
+
+static int parse_value(const char **cursor, const char *key, unsigned char *value)
+{
+    const char *found = strstr(*cursor, key);
+    if (!found) return -1;
+
+    char *end;
+    unsigned long x = strtoul(found + strlen(key), &end, 10);
+    if (end == found + strlen(key) || x > 255) return -1;
+    *value = x;
+    *cursor = end;
+
+    return 0;
+}
+
+/*
+ * UTC offset in seconds from "Z" or "+HH:MM". Older versions of the cli wrote
+ * negative offsets as "+-HH:MM", so every sign character up to the hours counts.
+ */
+static int parse_offset(const char *text, long *offset)
+{
+    if (*text == 'Z') { *offset = 0; return 0; }
+
+    int sign = 0;
+    for (; *text == '+' || *text == '-'; ++text) sign = sign < 0 || *text == '-' ? -1 : 1;
+    if (sign == 0) return -1;
+
+    unsigned hours, minutes;
+    if (sscanf(text, "%2u:%2u", &hours, &minutes) != 2 || hours > 23 || minutes > 59) return -1;
+    *offset = sign * (long)(hours * 3600 + minutes * 60);
+
+    return 0;
+}
+
+cms50f_status_t cms50f_recording_load(const char *filename, cms50f_recording_t *recording)
+{
+    if (!filename || !recording) return CMS50F_EINVAL;
+    memset(recording, 0, sizeof(*recording));
+
+    size_t size = {0};
+    char *buffer = read_file(filename, &size);
+    if (!buffer) return CMS50F_EFILE;
+
+    unsigned lines = 1;
+    for (const char *c = buffer; (c = memchr(c, '\n', buffer + size - c)) != NULL; ++c) ++lines;
+
+    recording->spo2 = malloc(lines);
+    recording->bpm = malloc(lines);
+    if (!recording->spo2 || !recording->bpm) {
+        free(buffer);
+        cms50f_recording_free(recording);
+        return CMS50F_ENOMEM;
+    }
+
+    cms50f_status_t status = CMS50F_SUCCESS;
+    for (char *line = buffer, *next; line && *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+        if (*line == '\0' || *line == '\r') continue;
+
+        if (recording->length == 0) {
+            struct tm info = {0};
+            int consumed = {0};
+            if (sscanf(line, "%d-%d-%dT%d:%d:%d%n", &info.tm_year, &info.tm_mon, &info.tm_mday, &info.tm_hour, &info.tm_min, &info.tm_sec, &consumed) != 6) {
+                status = CMS50F_EFORMAT;
+                break;
+            }
+            info.tm_year = info.tm_year - 1900;
+            info.tm_mon = info.tm_mon - 1;
+            info.tm_isdst = -1;
+
+            struct tm local = info;
+            time_t wall = mktime(&local);
+            long offset;
+            if (parse_offset(line + consumed, &offset) == 0) {
+                /*
+                 * Older versions of the cli always wrote the standard offset in
+                 * whole hours, also during daylight saving time. A file like
+                 * that from this zone is read as local time.
+                 */
+                time_t stamped = timegm(&info) - offset;
+                tzset();
+                recording->start = stamped != wall && offset == -timezone / 3600 * 3600 ? wall : stamped;
+            } else {
+                recording->start = wall;
+            }
+        }
+
+        const char *cursor = line;
+        if (parse_value(&cursor, "spo: ", &recording->spo2[recording->length]) < 0
+            || parse_value(&cursor, "bpm: ", &recording->bpm[recording->length]) < 0) {
+            status = CMS50F_EFORMAT;
+            break;
+        }
+        ++recording->length;
+    }
+    free(buffer);
+
+    if (status != CMS50F_SUCCESS) {
+        LOG_DEBUG("unexpected line %u in %s", recording->length + 1, filename);
+        cms50f_recording_free(recording);
+    }
+
+    return status;
+}
+
+void cms50f_recording_free(cms50f_recording_t *recording)
+{
+    if (!recording) return;
+    free(recording->spo2);
+    free(recording->bpm);
+    memset(recording, 0, sizeof(*recording));
+}
@@ -0,0 +1,28 @@
+//
+//  recording.h
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef recording_h
+#define recording_h
+
+#include "cms50f.h"
+
+/*
+ * A recording as written by the cli (YYYYMMDD_HHMMSS.txt) decoded into compact
+ * arrays. The device stores one sample per second, so sample i was taken at
+ * start + i.
+ */
+typedef struct {
+    time_t start;
+    unsigned length;
+    unsigned char *spo2;
+    unsigned char *bpm;
+} cms50f_recording_t;
+
+cms50f_status_t cms50f_recording_load(const char *filename, cms50f_recording_t *recording);
+void cms50f_recording_free(cms50f_recording_t *recording);
+
+#endif /* recording_h */
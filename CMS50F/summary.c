@@ -0,0 +1,189 @@
+//
+//  summary.c
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "summary.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#define SUMMARY_MAGIC               "CMS50FS1"
+
+void cms50f_summary_init(cms50f_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+}
+
+void cms50f_summary_add_recording(cms50f_summary_t *summary, const cms50f_recording_t *recording)
+{
+    cms50f_summary_t night;
+    cms50f_summary_init(&night);
+    night.nights = 1;
+    night.samples = recording->length;
+    if (recording->length > 0) {
+        night.first = recording->start;
+        night.last = recording->start + (int64_t)recording->length - 1;
+    }
+
+    unsigned last_spo2 = 100;
+    for (unsigned i = 0; i < recording->length; ++i) {
+        unsigned spo2 = recording->spo2[i];
+        unsigned bpm = recording->bpm[i];
+        if (spo2 == 0 || bpm == 0 || spo2 >= CMS50F_SUMMARY_SPO2_BINS) continue;
+
+        ++night.count;
+        night.sum_spo2 += spo2;
+        night.sum2_spo2 += spo2 * spo2;
+        night.sum_bpm += bpm;
+        night.sum2_bpm += bpm * bpm;
+        ++night.spo2[spo2];
+        ++night.bpm[bpm];
+
+        for (unsigned t = 0; t < CMS50F_SUMMARY_THRESHOLDS; ++t) {
+            unsigned threshold = CMS50F_SUMMARY_FIRST_THRESHOLD + t;
+            if (spo2 >= threshold && last_spo2 < threshold) ++night.episodes[t];
+        }
+        last_spo2 = spo2;
+    }
+
+    cms50f_summary_merge(summary, &night);
+}
+
+void cms50f_summary_merge(cms50f_summary_t *summary, const cms50f_summary_t *other)
+{
+    if (other->samples > 0 && summary->samples == 0) {
+        summary->first = other->first;
+        summary->last = other->last;
+    } else if (other->samples > 0) {
+        if (other->first < summary->first) summary->first = other->first;
+        if (other->last > summary->last) summary->last = other->last;
+    }
+
+    summary->nights += other->nights;
+    summary->samples += other->samples;
+    summary->count += other->count;
+    summary->sum_spo2 += other->sum_spo2;
+    summary->sum2_spo2 += other->sum2_spo2;
+    summary->sum_bpm += other->sum_bpm;
+    summary->sum2_bpm += other->sum2_bpm;
+    for (int i = 0; i < CMS50F_SUMMARY_SPO2_BINS; ++i) summary->spo2[i] += other->spo2[i];
+    for (int i = 0; i < CMS50F_SUMMARY_BPM_BINS; ++i) summary->bpm[i] += other->bpm[i];
+    for (int i = 0; i < CMS50F_SUMMARY_THRESHOLDS; ++i) summary->episodes[i] += other->episodes[i];
+}
+
+uint64_t cms50f_summary_seconds_below(const cms50f_summary_t *summary, unsigned threshold)
+{
+    uint64_t seconds = 0;
+    for (unsigned i = 0; i < threshold && i < CMS50F_SUMMARY_SPO2_BINS; ++i) seconds += summary->spo2[i];
+    return seconds;
+}
+
+uint64_t cms50f_summary_episodes_below(const cms50f_summary_t *summary, unsigned threshold)
+{
+    if (threshold < CMS50F_SUMMARY_FIRST_THRESHOLD || threshold >= CMS50F_SUMMARY_FIRST_THRESHOLD + CMS50F_SUMMARY_THRESHOLDS) return 0;
+    return summary->episodes[threshold - CMS50F_SUMMARY_FIRST_THRESHOLD];
+}
+
+unsigned cms50f_summary_spo2_percentile(const cms50f_summary_t *summary, double percentile)
+{
+    if (summary->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)ceil(percentile / 100 * summary->count);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < CMS50F_SUMMARY_SPO2_BINS; ++i) {
+        seen += summary->spo2[i];
+        if (seen >= rank) return i;
+    }
+    return CMS50F_SUMMARY_SPO2_BINS - 1;
+}
+
+static void put(unsigned char **cursor, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) *(*cursor)++ = (value >> (8 * i)) & 0xff;
+}
+
+static uint64_t get(const unsigned char **cursor)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) value |= (uint64_t)*(*cursor)++ << (8 * i);
+    return value;
+}
+
+/* magic followed by every counter as little endian 64 bit integer, in declaration order */
+void cms50f_summary_serialize(const cms50f_summary_t *summary, unsigned char buffer[CMS50F_SUMMARY_SIZE])
+{
+    memcpy(buffer, SUMMARY_MAGIC, 8);
+    unsigned char *cursor = buffer + 8;
+
+    put(&cursor, summary->nights);
+    put(&cursor, summary->samples);
+    put(&cursor, (uint64_t)summary->first);
+    put(&cursor, (uint64_t)summary->last);
+    put(&cursor, summary->count);
+    put(&cursor, summary->sum_spo2);
+    put(&cursor, summary->sum2_spo2);
+    put(&cursor, summary->sum_bpm);
+    put(&cursor, summary->sum2_bpm);
+    for (int i = 0; i < CMS50F_SUMMARY_SPO2_BINS; ++i) put(&cursor, summary->spo2[i]);
+    for (int i = 0; i < CMS50F_SUMMARY_BPM_BINS; ++i) put(&cursor, summary->bpm[i]);
+    for (int i = 0; i < CMS50F_SUMMARY_THRESHOLDS; ++i) put(&cursor, summary->episodes[i]);
+}
+
+cms50f_status_t cms50f_summary_deserialize(cms50f_summary_t *summary, const unsigned char *buffer, size_t length)
+{
+    if (!summary || !buffer) return CMS50F_EINVAL;
+    if (length != CMS50F_SUMMARY_SIZE || memcmp(buffer, SUMMARY_MAGIC, 8) != 0) return CMS50F_EFORMAT;
+    const unsigned char *cursor = buffer + 8;
+
+    summary->nights = get(&cursor);
+    summary->samples = get(&cursor);
+    summary->first = (int64_t)get(&cursor);
+    summary->last = (int64_t)get(&cursor);
+    summary->count = get(&cursor);
+    summary->sum_spo2 = get(&cursor);
+    summary->sum2_spo2 = get(&cursor);
+    summary->sum_bpm = get(&cursor);
+    summary->sum2_bpm = get(&cursor);
+    for (int i = 0; i < CMS50F_SUMMARY_SPO2_BINS; ++i) summary->spo2[i] = get(&cursor);
+    for (int i = 0; i < CMS50F_SUMMARY_BPM_BINS; ++i) summary->bpm[i] = get(&cursor);
+    for (int i = 0; i < CMS50F_SUMMARY_THRESHOLDS; ++i) summary->episodes[i] = get(&cursor);
+
+    return CMS50F_SUCCESS;
+}
+
+cms50f_status_t cms50f_summary_save(const cms50f_summary_t *summary, const char *filename)
+{
+    unsigned char buffer[CMS50F_SUMMARY_SIZE];
+    cms50f_summary_serialize(summary, buffer);
+
+    FILE *out = {0};
+    if ((out = fopen(filename, "wb")) == NULL) {
+        LOG_DEBUG("file %s could not be opened: %s", filename, strerror(errno));
+        return CMS50F_EFILE;
+    }
+    size_t n = fwrite(buffer, 1, sizeof(buffer), out);
+    if (fclose(out) == EOF || n != sizeof(buffer)) return CMS50F_EFILE;
+
+    return CMS50F_SUCCESS;
+}
+
+cms50f_status_t cms50f_summary_load(cms50f_summary_t *summary, const char *filename)
+{
+    unsigned char buffer[CMS50F_SUMMARY_SIZE + 1];
+
+    FILE *in = {0};
+    if ((in = fopen(filename, "rb")) == NULL) {
+        LOG_DEBUG("file %s could not be opened: %s", filename, strerror(errno));
+        return CMS50F_EFILE;
+    }
+    size_t n = fread(buffer, 1, sizeof(buffer), in);
+    fclose(in);
+
+    return cms50f_summary_deserialize(summary, buffer, n);
+}
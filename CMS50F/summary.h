@@ -0,0 +1,57 @@
+//
+//  summary.h
+//  CMS50F
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef summary_h
+#define summary_h
+
+#include "recording.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define CMS50F_SUMMARY_SPO2_BINS        101     /* 0 ... 100 % */
+#define CMS50F_SUMMARY_BPM_BINS         256     /* 0 ... 255 bpm */
+#define CMS50F_SUMMARY_FIRST_THRESHOLD  80
+#define CMS50F_SUMMARY_THRESHOLDS       20      /* episodes below 80 ... 99 % */
+#define CMS50F_SUMMARY_SIZE             (8 + 8 * (9 + CMS50F_SUMMARY_SPO2_BINS + CMS50F_SUMMARY_BPM_BINS + CMS50F_SUMMARY_THRESHOLDS))
+
+/*
+ * Statistics of any number of nights that only consist of integer counters,
+ * so merging two summaries is exact, associative and commutative. Samples
+ * without signal only count towards samples. Time below a threshold is read
+ * from the SpO2 histogram, episodes are counted like the gnuplot labels.
+ */
+typedef struct {
+    uint64_t nights;
+    uint64_t samples;
+    int64_t first;                  /* first and last second covered, only valid with samples */
+    int64_t last;
+
+    uint64_t count;
+    uint64_t sum_spo2;
+    uint64_t sum2_spo2;
+    uint64_t sum_bpm;
+    uint64_t sum2_bpm;
+
+    uint64_t spo2[CMS50F_SUMMARY_SPO2_BINS];
+    uint64_t bpm[CMS50F_SUMMARY_BPM_BINS];
+    uint64_t episodes[CMS50F_SUMMARY_THRESHOLDS];
+} cms50f_summary_t;
+
+void cms50f_summary_init(cms50f_summary_t *summary);
+void cms50f_summary_add_recording(cms50f_summary_t *summary, const cms50f_recording_t *recording);
+void cms50f_summary_merge(cms50f_summary_t *summary, const cms50f_summary_t *other);
+
+uint64_t cms50f_summary_seconds_below(const cms50f_summary_t *summary, unsigned threshold);
+uint64_t cms50f_summary_episodes_below(const cms50f_summary_t *summary, unsigned threshold);
+unsigned cms50f_summary_spo2_percentile(const cms50f_summary_t *summary, double percentile);
+
+void cms50f_summary_serialize(const cms50f_summary_t *summary, unsigned char buffer[CMS50F_SUMMARY_SIZE]);
+cms50f_status_t cms50f_summary_deserialize(cms50f_summary_t *summary, const unsigned char *buffer, size_t length);
+cms50f_status_t cms50f_summary_save(const cms50f_summary_t *summary, const char *filename);
+cms50f_status_t cms50f_summary_load(cms50f_summary_t *summary, const char *filename);
+
+#endif /* summary_h */
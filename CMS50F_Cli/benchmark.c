@@ -0,0 +1,210 @@
+//
+//  benchmark.c
+//  CMS50F_Cli
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "server.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SAMPLE_POINTS               500
+
+struct connection {
+    FILE *in;
+    FILE *out;
+};
+
+struct client {
+    const char *socket_path;
+    char (*nights)[SERVER_NAME_SIZE];
+    unsigned night_count;
+    unsigned offset;
+    unsigned requests;
+    double *latencies;
+    int failed;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connection_open(struct connection *connection, const char *socket_path)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        LOG_ERROR("could not connect to %s: %s", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    int out_fd = dup(fd);
+    connection->in = fdopen(fd, "r");
+    connection->out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+    if (!connection->in || !connection->out) {
+        if (connection->in) fclose(connection->in); else close(fd);
+        if (connection->out) fclose(connection->out); else if (out_fd >= 0) close(out_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void connection_close(struct connection *connection)
+{
+    fclose(connection->in);
+    fclose(connection->out);
+}
+
+/* sends one request and reads the complete answer, every line is passed to the optional callback */
+static int request(struct connection *connection, const char *line, void (*callback)(const char *line, void *context), void *context)
+{
+    fprintf(connection->out, "%s\n", line);
+    if (fflush(connection->out) == EOF) return -1;
+
+    char buffer[256] = {0};
+    unsigned count;
+    if (!fgets(buffer, sizeof(buffer), connection->in) || sscanf(buffer, "ok %u", &count) != 1) {
+        LOG_ERROR("request '%s' failed: %s", line, buffer);
+        return -1;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (!fgets(buffer, sizeof(buffer), connection->in)) return -1;
+        if (callback) callback(buffer, context);
+    }
+
+    return (int)count;
+}
+
+static void add_night(const char *line, void *context)
+{
+    struct client *client = context;
+    void *grown = realloc(client->nights, (client->night_count + 1) * SERVER_NAME_SIZE);
+    if (!grown) return;
+    client->nights = grown;
+    memset(client->nights[client->night_count], 0, SERVER_NAME_SIZE);
+    strncpy(client->nights[client->night_count], line, strcspn(line, "\n") < SERVER_NAME_SIZE ? strcspn(line, "\n") : SERVER_NAME_SIZE - 1);
+    ++client->night_count;
+}
+
+static void *run_client(void *arg)
+{
+    struct client *client = arg;
+    struct connection connection;
+    if (connection_open(&connection, client->socket_path) < 0) { client->failed = 1; return NULL; }
+
+    char line[128];
+    for (unsigned i = 0; i < client->requests; ++i) {
+        const char *night = client->nights[(client->offset + i / 2) % client->night_count];
+        if (i % 2 == 0) snprintf(line, sizeof(line), "stats %s", night);
+        else snprintf(line, sizeof(line), "samples %s 0 %ld %d", night, LONG_MAX, SAMPLE_POINTS);
+
+        double begin = now();
+        if (request(&connection, line, NULL, NULL) < 0) { client->failed = 1; break; }
+        client->latencies[i] = now() - begin;
+    }
+
+    connection_close(&connection);
+    return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int cms50f_server_benchmark(const char *socket_path, unsigned clients, unsigned requests)
+{
+    if (clients == 0 || requests == 0) return -1;
+
+    struct client nights = { .socket_path = socket_path };
+    struct connection connection;
+    if (connection_open(&connection, socket_path) < 0) return -1;
+    if (request(&connection, "list", add_night, &nights) <= 0) {
+        LOG_ERROR("%s", "no nights to query");
+        connection_close(&connection);
+        return -1;
+    }
+
+    /* the first request of every night decodes it, report that separately */
+    double begin = now();
+    char line[128];
+    for (unsigned i = 0; i < nights.night_count; ++i) {
+        snprintf(line, sizeof(line), "stats %s", nights.nights[i]);
+        request(&connection, line, NULL, NULL);
+    }
+    printf("%u nights, first query of each took %.3f ms on average\n", nights.night_count, (now() - begin) * 1e3 / nights.night_count);
+    connection_close(&connection);
+
+    struct client *client = calloc(clients, sizeof(struct client));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    int *started = calloc(clients, sizeof(int));
+    double *latencies = calloc((size_t)clients * requests, sizeof(double));
+    if (!client || !threads || !started || !latencies) {
+        LOG_ERROR("%s", "out of memory");
+        free(client); free(threads); free(started); free(latencies); free(nights.nights);
+        return -1;
+    }
+
+    begin = now();
+    for (unsigned i = 0; i < clients; ++i) {
+        client[i] = nights;
+        client[i].offset = i;
+        client[i].requests = requests;
+        client[i].latencies = latencies + (size_t)i * requests;
+        started[i] = pthread_create(&threads[i], NULL, run_client, &client[i]) == 0;
+        if (!started[i]) LOG_ERROR("could not start client %u", i);
+    }
+    int failed = 0;
+    for (unsigned i = 0; i < clients; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        failed |= !started[i] || client[i].failed;
+    }
+    double elapsed = now() - begin;
+
+    /* only clients that ran have latencies */
+    size_t total = 0;
+    for (unsigned i = 0; i < clients; ++i) {
+        if (!started[i]) continue;
+        memmove(latencies + total, client[i].latencies, requests * sizeof(double));
+        total += requests;
+    }
+    if (total == 0) {
+        free(client); free(threads); free(started); free(latencies); free(nights.nights);
+        return -1;
+    }
+
+    double sum = 0;
+    for (size_t i = 0; i < total; ++i) sum += latencies[i];
+    qsort(latencies, total, sizeof(double), compare_latencies);
+
+    printf("%zu clients x %u requests in %.3f s, %.0f requests/s\n", total / requests, requests, elapsed, total / elapsed);
+    printf("latency mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           sum / total * 1e6, latencies[total / 2] * 1e6, latencies[total * 99 / 100] * 1e6, latencies[total - 1] * 1e6);
+
+    free(client);
+    free(threads);
+    free(started);
+    free(latencies);
+    free(nights.nights);
+
+    return failed ? -1 : 0;
+}
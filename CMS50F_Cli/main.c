@@ -6,6 +6,12 @@
 //
 
 #include "cms50f.h"
+#include "arrow.h"
+#include "recording.h"
+#include "analysis.h"
+#include "summary.h"
+#include "server.h"
+#include "watch.h"
 #include "log.h"
 #include <stdio.h>
 #include <time.h>
@@ -16,29 +22,27 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <locale.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 
 #define DEVICE "/dev/tty.usbserial-0001"
+#define BENCHMARK_CLIENTS 4
+#define BENCHMARK_REQUESTS 10000
+#define MERGE_WORKERS 16
 
 static void print(FILE *stream, time_t *timestamp, spo2_t spo2, bpm_t bpm)
 {
-    static char timezone_buffer[7] = {0};
-    if (timezone_buffer[0] == 0) {
-        tzset();
-        long hours = -timezone / 3600;
-        if (hours == 0) {
-            timezone_buffer[0] = 'Z';
-        } else if (hours > 0) {
-            long minutes = labs(timezone / 3600) / 60;
-            snprintf(timezone_buffer, sizeof(timezone_buffer), "+%02ld:%02ld", hours, minutes);
-        } else if (hours < 0) {
-            long minutes = labs(timezone / 3600) / 60;
-            snprintf(timezone_buffer, sizeof(timezone_buffer), "+%02ld:%02ld", hours, minutes);
-        }
-    }
+    const struct tm *local = localtime(timestamp);
+
+    /* the offset in effect at that time, daylight saving time included */
+    char offset[8] = {0};
+    strftime(offset, sizeof(offset), "%z", local);
 
     char buffer[32] = {0};
-    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", localtime(timestamp));
-    strncat(buffer, timezone_buffer, sizeof(buffer) - strlen(buffer) - 1);
+    size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", local);
+    if (strcmp(offset, "+0000") == 0) snprintf(buffer + length, sizeof(buffer) - length, "Z");
+    else snprintf(buffer + length, sizeof(buffer) - length, "%.3s:%.2s", offset, offset + 3);
     fprintf(stream, "%s, spo: %d, bpm: %d\n", buffer, spo2, bpm);
 }
 
@@ -100,6 +104,170 @@ static void print_to_csv_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigne
     }
 }
 
+/* first error of a sink during the current import, import_recording reports it */
+static cms50f_status_t sink_status = CMS50F_SUCCESS;
+
+static void print_to_arrow_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    static cms50f_arrow_writer_t out = {0};
+    static cms50f_status_t status = CMS50F_SUCCESS;
+    if (out == 0 && status == CMS50F_SUCCESS) {
+        char buffer[32] = {0};
+        strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%S.arrow", localtime(timestamp));
+        if ((out = cms50f_arrow_writer_open(buffer, 0)) == NULL) {
+            LOG_ERROR("could not open file: %s", buffer);
+            status = CMS50F_EFILE;
+        } else {
+            LOG_DEBUG("file %s opened", buffer);
+        }
+    }
+    if (status == CMS50F_SUCCESS) status = cms50f_arrow_writer_append(out, *timestamp, spo2, bpm);
+    if (rest == 0) {
+        if (out) {
+            cms50f_status_t close_status = cms50f_arrow_writer_close(&out);
+            if (status == CMS50F_SUCCESS) status = close_status;
+        }
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("could not write arrow file: %s", cms50f_strerror(status));
+            sink_status = status;
+        } else {
+            LOG_DEBUG("%s", "file closed");
+        }
+        status = CMS50F_SUCCESS;
+    }
+}
+
+static cms50f_arrow_writer_t arrow_table = {0};
+
+static void append_to_arrow_table(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    static cms50f_status_t status = CMS50F_SUCCESS;
+    if (status == CMS50F_SUCCESS) status = cms50f_arrow_writer_append(arrow_table, *timestamp, spo2, bpm);
+    if (rest == 0) {
+        cms50f_status_t end_status = cms50f_arrow_writer_end_night(arrow_table);
+        if (status == CMS50F_SUCCESS) status = end_status;
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("could not write night to arrow table: %s", cms50f_strerror(status));
+            sink_status = status;
+        }
+        status = CMS50F_SUCCESS;
+    }
+}
+
+static void write_analysis(FILE *out, const cms50f_analysis_t *analysis)
+{
+    fprintf(out, "# desaturations = %u\n", analysis->desaturations);
+    fprintf(out, "# desaturation_index = %.1f\n", analysis->desaturation_index);
+    fprintf(out, "# periodic_desaturations = %u\n", analysis->periodic_desaturations);
+    fprintf(out, "# cycle_period = %.1f\n", analysis->cycle_period);
+    fprintf(out, "# cycle_power = %.3f\n\n", analysis->cycle_power);
+
+    fprintf(out, "%s\n", "# DATE, TIME, MEAN_BPM, SD_BPM, RMSSD_BPM, MEAN_SPO2, SD_SPO2");
+    for (unsigned i = 0; i < analysis->window_count; ++i) {
+        const cms50f_variability_t *window = &analysis->windows[i];
+        char buffer[32] = {0};
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d, %H:%M:%S", localtime(&window->start));
+        fprintf(out, "%s, %.2f, %.2f, %.2f, %.2f, %.2f\n", buffer, window->mean_bpm, window->sd_bpm, window->rmssd_bpm, window->mean_spo2, window->sd_spo2);
+    }
+
+    fprintf(out, "\n\n%s\n", "# FREQUENCY, SPO2_POWER, BPM_POWER");
+    for (unsigned k = 0; k < analysis->bins; ++k)
+        fprintf(out, "%.6f, %.6g, %.6g\n", k * analysis->resolution, analysis->spo2_power[k], analysis->bpm_power[k]);
+}
+
+/* collects a whole night for the sinks that need all samples, rest tells the size up front */
+static int append_sample(cms50f_recording_t *recording, time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    if (recording->spo2 == 0) {
+        recording->start = *timestamp;
+        recording->spo2 = malloc(rest + 1);
+        recording->bpm = malloc(rest + 1);
+        if (!recording->spo2 || !recording->bpm) {
+            LOG_ERROR("%s", cms50f_strerror(CMS50F_ENOMEM));
+            cms50f_recording_free(recording);
+            return -1;
+        }
+    }
+    recording->spo2[recording->length] = spo2;
+    recording->bpm[recording->length] = bpm;
+    ++recording->length;
+
+    return 0;
+}
+
+static void print_to_analysis_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    static cms50f_recording_t recording = {0};
+    if (append_sample(&recording, timestamp, spo2, bpm, rest) < 0) return;
+
+    if (rest == 0) {
+        cms50f_analysis_t analysis;
+        cms50f_status_t status = cms50f_analysis_run(&recording, &analysis);
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("analysis failed: %s", cms50f_strerror(status));
+        } else {
+            FILE *out = {0};
+            char buffer[32] = {0};
+            strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%S_analysis.txt", localtime(&recording.start));
+            if ((out = fopen(buffer, "w")) == NULL) {
+                LOG_ERROR("could not open file: %s", buffer);
+            } else {
+                write_analysis(out, &analysis);
+                if (fclose(out) == EOF) LOG_ERROR("could not close file: %s", strerror(errno));
+                else LOG_DEBUG("%s", "file closed");
+            }
+            cms50f_analysis_free(&analysis);
+        }
+        cms50f_recording_free(&recording);
+    }
+}
+
+static void print_summary(FILE *out, const cms50f_summary_t *summary)
+{
+    double count = summary->count ? summary->count : 1;
+    double mean_spo2 = summary->sum_spo2 / count;
+    double mean_bpm = summary->sum_bpm / count;
+    double variance_spo2 = summary->count > 1 ? (summary->sum2_spo2 - summary->sum_spo2 * mean_spo2) / (count - 1) : 0;
+    double variance_bpm = summary->count > 1 ? (summary->sum2_bpm - summary->sum_bpm * mean_bpm) / (count - 1) : 0;
+
+    fprintf(out, "nights = %" PRIu64 "\n", summary->nights);
+    fprintf(out, "hours = %.1f\n", summary->samples / 3600.0);
+    fprintf(out, "hours_with_signal = %.1f\n\n", summary->count / 3600.0);
+
+    fprintf(out, "mean_spo2 = %.2f\n", mean_spo2);
+    fprintf(out, "sd_spo2 = %.2f\n", variance_spo2 > 0 ? sqrt(variance_spo2) : 0);
+    fprintf(out, "median_spo2 = %u\n", cms50f_summary_spo2_percentile(summary, 50));
+    fprintf(out, "p5_spo2 = %u\n\n", cms50f_summary_spo2_percentile(summary, 5));
+
+    fprintf(out, "mean_bpm = %.2f\n", mean_bpm);
+    fprintf(out, "sd_bpm = %.2f\n\n", variance_bpm > 0 ? sqrt(variance_bpm) : 0);
+
+    for (unsigned threshold = 88; threshold <= 92; ++threshold) {
+        fprintf(out, "below_%u = %" PRIu64 "\n", threshold, cms50f_summary_episodes_below(summary, threshold));
+        fprintf(out, "count_below_%u = %" PRIu64 "\n", threshold, cms50f_summary_seconds_below(summary, threshold));
+    }
+}
+
+static void print_to_summary_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    static cms50f_recording_t recording = {0};
+    if (append_sample(&recording, timestamp, spo2, bpm, rest) < 0) return;
+
+    if (rest == 0) {
+        cms50f_summary_t summary;
+        cms50f_summary_init(&summary);
+        cms50f_summary_add_recording(&summary, &recording);
+
+        char buffer[32] = {0};
+        strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%S.summary", localtime(&recording.start));
+        cms50f_status_t status = cms50f_summary_save(&summary, buffer);
+        if (status != CMS50F_SUCCESS) LOG_ERROR("could not write file %s: %s", buffer, cms50f_strerror(status));
+        else LOG_DEBUG("file %s written", buffer);
+
+        cms50f_recording_free(&recording);
+    }
+}
+
 static void print_to_gnuplot_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
 {
     static FILE *out = {0};
@@ -141,7 +309,7 @@ static void print_to_gnuplot_file(time_t *timestamp, spo2_t spo2, bpm_t bpm, uns
         strftime(csv_filename, sizeof(csv_filename), "%Y%m%d%H%M%S.csv", localtime(timestamp));
         strftime(first_timestamp, sizeof(first_timestamp), "%Y-%m-%d, %H:%M:%S", localtime(timestamp));
 
-        setlocale(LC_ALL, "de_DE");
+        setlocale(LC_TIME, "de_DE");
         strftime(title, sizeof(title), "%d %B %Y", localtime(timestamp));
     }
 
@@ -221,9 +389,170 @@ static void print_all(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
     print_to_stdout(timestamp, spo2, bpm, rest);
     print_to_file(timestamp, spo2, bpm, rest);
     print_to_csv_file(timestamp, spo2, bpm, rest);
+    print_to_arrow_file(timestamp, spo2, bpm, rest);
+    print_to_analysis_file(timestamp, spo2, bpm, rest);
+    print_to_summary_file(timestamp, spo2, bpm, rest);
     print_to_gnuplot_file(timestamp, spo2, bpm, rest);
 }
 
+static void convert_all(time_t *timestamp, spo2_t spo2, bpm_t bpm, unsigned rest)
+{
+    print_to_csv_file(timestamp, spo2, bpm, rest);
+    print_to_arrow_file(timestamp, spo2, bpm, rest);
+    print_to_analysis_file(timestamp, spo2, bpm, rest);
+    print_to_summary_file(timestamp, spo2, bpm, rest);
+    print_to_gnuplot_file(timestamp, spo2, bpm, rest);
+}
+
+static int import_recording(const char *input_file, handler_t handler)
+{
+    printf("Loading data from file: %s\n", input_file);
+
+    cms50f_recording_t recording;
+    cms50f_status_t status = cms50f_recording_load(input_file, &recording);
+    if (status != CMS50F_SUCCESS) {
+        LOG_ERROR("could not load file %s: %s", input_file, cms50f_strerror(status));
+        return -1;
+    }
+
+    printf("line_count: %u\n", recording.length);
+
+    sink_status = CMS50F_SUCCESS;
+    for (unsigned i = 0; i < recording.length; ++i) {
+        time_t time = recording.start + i;
+        handler(&time, recording.spo2[i], recording.bpm[i], recording.length - 1 - i);
+    }
+
+    cms50f_recording_free(&recording);
+    if (sink_status != CMS50F_SUCCESS) {
+        LOG_ERROR("could not convert file %s: %s", input_file, cms50f_strerror(sink_status));
+        return -1;
+    }
+    return 0;
+}
+
+static int analyse_recordings(char *filenames[], int count)
+{
+    printf("NIGHT\tSAMPLES\tDESATURATIONS\tODI\tPERIODIC\tCYCLE_PERIOD\tCYCLE_POWER\tMEAN_RMSSD\tMS\n");
+    for (int i = 0; i < count; ++i) {
+        cms50f_recording_t recording;
+        cms50f_status_t status = cms50f_recording_load(filenames[i], &recording);
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("could not load file %s: %s", filenames[i], cms50f_strerror(status));
+            continue;
+        }
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        cms50f_analysis_t analysis;
+        status = cms50f_analysis_run(&recording, &analysis);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("analysis of %s failed: %s", filenames[i], cms50f_strerror(status));
+            cms50f_recording_free(&recording);
+            continue;
+        }
+
+        double rmssd = 0;
+        unsigned windows = 0;
+        for (unsigned w = 0; w < analysis.window_count; ++w) {
+            if (analysis.windows[w].valid == 0) continue;
+            rmssd += analysis.windows[w].rmssd_bpm;
+            ++windows;
+        }
+
+        char buffer[32] = {0};
+        strftime(buffer, sizeof(buffer), "%Y%m%d_%H%M%S", localtime(&recording.start));
+        printf("%s\t%u\t%u\t%.1f\t%u\t%.1f\t%.3f\t%.2f\t%.2f\n", buffer, recording.length,
+               analysis.desaturations, analysis.desaturation_index, analysis.periodic_desaturations,
+               analysis.cycle_period, analysis.cycle_power, windows ? rmssd / windows : 0,
+               (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+
+        cms50f_analysis_free(&analysis);
+        cms50f_recording_free(&recording);
+    }
+
+    return 0;
+}
+
+struct partial_summary {
+    char **filenames;
+    int count;
+    int offset;
+    int stride;
+    int failed;
+    cms50f_summary_t summary;
+};
+
+static void *summarize(void *arg)
+{
+    struct partial_summary *partial = arg;
+    cms50f_summary_init(&partial->summary);
+
+    for (int i = partial->offset; i < partial->count; i += partial->stride) {
+        const char *filename = partial->filenames[i];
+        size_t length = strlen(filename);
+        cms50f_status_t status;
+        if (length > 8 && strcmp(filename + length - 8, ".summary") == 0) {
+            cms50f_summary_t summary;
+            if ((status = cms50f_summary_load(&summary, filename)) == CMS50F_SUCCESS) cms50f_summary_merge(&partial->summary, &summary);
+        } else {
+            cms50f_recording_t recording;
+            if ((status = cms50f_recording_load(filename, &recording)) == CMS50F_SUCCESS) {
+                cms50f_summary_add_recording(&partial->summary, &recording);
+                cms50f_recording_free(&recording);
+            }
+        }
+        if (status != CMS50F_SUCCESS) {
+            LOG_ERROR("could not summarize %s: %s", filename, cms50f_strerror(status));
+            partial->failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+/* recordings and summaries are spread over the workers, their partial summaries are merged at the end */
+static int merge_summaries(const char *output, char *filenames[], int count)
+{
+    static struct partial_summary partial[MERGE_WORKERS];
+    pthread_t threads[MERGE_WORKERS];
+    int started[MERGE_WORKERS] = {0};
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : cpus > MERGE_WORKERS ? MERGE_WORKERS : (int)cpus;
+    if (workers > count) workers = count > 0 ? count : 1;
+
+    for (int w = 0; w < workers; ++w) {
+        partial[w] = (struct partial_summary){ .filenames = filenames, .count = count, .offset = w, .stride = workers };
+        started[w] = pthread_create(&threads[w], NULL, summarize, &partial[w]) == 0;
+        if (!started[w]) summarize(&partial[w]);
+    }
+
+    int failed = 0;
+    cms50f_summary_t summary;
+    cms50f_summary_init(&summary);
+    for (int w = 0; w < workers; ++w) {
+        if (started[w]) pthread_join(threads[w], NULL);
+        cms50f_summary_merge(&summary, &partial[w].summary);
+        failed |= partial[w].failed;
+    }
+
+    cms50f_status_t status = cms50f_summary_save(&summary, output);
+    if (status != CMS50F_SUCCESS) {
+        LOG_ERROR("could not write file %s: %s", output, cms50f_strerror(status));
+        return 1;
+    }
+    print_summary(stdout, &summary);
+
+    return failed;
+}
+
+static int convert_recording(const char *filename)
+{
+    return import_recording(filename, &convert_all);
+}
+
 void die(cms50f_device_t device, cms50f_status_t status) {
     LOG_ERROR("%s", cms50f_strerror(status));
     if (status == CMS50F_EUNEXP) { /* can this be handled better? */}
@@ -235,54 +564,82 @@ int main(int argc, char *argv[]) {
     int option;
     unsigned force_count = 0;
     const char *input_file = NULL;
-    while ((option = getopt(argc, argv, "c:i:")) != -1)
+    const char *arrow_filename = NULL;
+    const char *socket_path = NULL;
+    const char *benchmark_socket_path = NULL;
+    const char *summary_filename = NULL;
+    const char *watch_directory = NULL;
+    int analyse = 0;
+    while ((option = getopt(argc, argv, "a:b:c:i:m:s:w:x")) != -1)
     {
         switch (option)
         {
+            case 'a':
+                arrow_filename = optarg;
+                break;
+            case 'b':
+                benchmark_socket_path = optarg;
+                break;
             case 'c':
                 force_count = atoi(optarg);
                 break;
             case 'i':
                 input_file = optarg;
                 break;
+            case 'm':
+                summary_filename = optarg;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'w':
+                watch_directory = optarg;
+                break;
+            case 'x':
+                analyse = 1;
+                break;
             default:
                 abort();
         }
     }
 
-    if (input_file) {
-        printf("Loading data from file: %s\n", input_file);
+    if (socket_path) {
+        return cms50f_server_run(socket_path, optind < argc ? argv[optind] : ".") < 0 ? 1 : 0;
+    }
 
-        FILE *in = {0};
-        char fullpath[PATH_MAX];
+    if (benchmark_socket_path) {
+        return cms50f_server_benchmark(benchmark_socket_path, BENCHMARK_CLIENTS, BENCHMARK_REQUESTS) < 0 ? 1 : 0;
+    }
 
-        if ((in = fopen(input_file, "r")) == NULL) {
-            LOG_ERROR("could not open file: %s", input_file);
-        }
-        realpath(input_file, fullpath);
-        LOG_DEBUG("file %s opened", fullpath);
+    if (watch_directory) {
+        return cms50f_watch_run(watch_directory, &convert_recording) < 0 ? 1 : 0;
+    }
+
+    if (summary_filename) {
+        return merge_summaries(summary_filename, argv + optind, argc - optind);
+    }
 
-        unsigned line_count = {0};
-        ssize_t read;
-        char *line;
-        size_t len;
-        while ((read = getline(&line, &len, in)) != -1) ++line_count;
-
-        printf("line_count: %u\n", line_count);
-
-        fseek(in, 0, SEEK_SET);
-
-        struct tm info;
-        int spo2, bpm;
-        while (line_count > 0) {
-            fscanf(in, "%d-%d-%dT%d:%d:%d+01:00, spo: %d, bpm: %d", &info.tm_year, &info.tm_mon, &info.tm_mday, &info.tm_hour, &info.tm_min, &info.tm_sec, &spo2, &bpm);
-            info.tm_year = info.tm_year - 1900;
-            info.tm_mon = info.tm_mon - 1;
-            time_t time = mktime(&info);
-            print_to_csv_file(&time, spo2, bpm, --line_count);
-            print_to_gnuplot_file(&time, spo2, bpm, line_count);
+    if (analyse) {
+        return analyse_recordings(argv + optind, argc - optind);
+    }
+
+    if (arrow_filename) {
+        if ((arrow_table = cms50f_arrow_writer_open(arrow_filename, 1)) == NULL) {
+            LOG_ERROR("could not open file: %s", arrow_filename);
+            return 1;
         }
+        int failed = 0;
+        for (int i = optind; i < argc; ++i) failed |= import_recording(argv[i], &append_to_arrow_table) < 0;
+
+        cms50f_status_t status = cms50f_arrow_writer_close(&arrow_table);
+        if (status != CMS50F_SUCCESS) { LOG_ERROR("could not write arrow file: %s", cms50f_strerror(status)); return 1; }
+        printf("Done");
 
+        return failed;
+    }
+
+    if (input_file) {
+        if (import_recording(input_file, &convert_all) < 0) return 1;
         printf("Done");
 
         return 0;
@@ -0,0 +1,537 @@
+//
+//  server.c
+//  CMS50F_Cli
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "server.h"
+#include "recording.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CACHE_SIZE                  32
+#define REQUEST_SIZE                256
+#define MIN_WORKERS                 4
+#define MAX_WORKERS                 16
+#define THRESHOLD_COUNT             3
+
+static const unsigned thresholds[THRESHOLD_COUNT] = { 90, 91, 92 };
+
+/* same rules as the gnuplot statistics: samples without signal are skipped */
+struct stats {
+    unsigned valid;
+    unsigned min_spo2;
+    unsigned max_spo2;
+    unsigned long sum_spo2;
+    unsigned min_bpm;
+    unsigned max_bpm;
+    unsigned long sum_bpm;
+    unsigned below[THRESHOLD_COUNT];
+    unsigned count_below[THRESHOLD_COUNT];
+};
+
+struct night {
+    char name[SERVER_NAME_SIZE];
+    long long size;                 /* of the file when it was decoded */
+    long long mtime;
+    cms50f_recording_t recording;
+    struct stats stats;
+    unsigned long last_used;
+    unsigned references;
+    int cached;
+};
+
+static const char *directory = {0};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct night *cache[CACHE_SIZE] = {0};
+static unsigned long cache_clock = {0};
+
+/* a connection is either waiting in the poll set, queued or with exactly one worker */
+struct connection {
+    int fd;
+    FILE *out;
+    char request[REQUEST_SIZE];
+    size_t length;
+    struct connection *next;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static struct connection *queue_head = {0};
+static struct connection *queue_tail = {0};
+static int idle_pipe[2] = { -1, -1 };
+
+static void compute_stats(const cms50f_recording_t *recording, struct stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min_spo2 = 100;
+    stats->min_bpm = 255;
+
+    unsigned last_spo2 = 100;
+    for (unsigned i = 0; i < recording->length; ++i) {
+        unsigned spo2 = recording->spo2[i];
+        unsigned bpm = recording->bpm[i];
+        if (spo2 == 0 || bpm == 0) continue;
+
+        if (spo2 < stats->min_spo2) stats->min_spo2 = spo2;
+        if (spo2 > stats->max_spo2) stats->max_spo2 = spo2;
+        stats->sum_spo2 += spo2;
+
+        if (bpm < stats->min_bpm) stats->min_bpm = bpm;
+        if (bpm > stats->max_bpm) stats->max_bpm = bpm;
+        stats->sum_bpm += bpm;
+
+        for (int t = 0; t < THRESHOLD_COUNT; ++t) {
+            if (spo2 >= thresholds[t] && last_spo2 < thresholds[t]) ++stats->below[t];
+            if (spo2 < thresholds[t]) ++stats->count_below[t];
+        }
+
+        last_spo2 = spo2;
+        ++stats->valid;
+    }
+}
+
+static int is_night_name(const char *name)
+{
+    size_t length = strlen(name);
+    if (length == 0 || length >= SERVER_NAME_SIZE) return 0;
+    return strspn(name, "0123456789_") == length;
+}
+
+static void night_free(struct night *night)
+{
+    cms50f_recording_free(&night->recording);
+    free(night);
+}
+
+/* drops a night from the cache, it is freed once the last reference is gone */
+static void night_uncache(int slot)
+{
+    struct night *night = cache[slot];
+    cache[slot] = NULL;
+    night->cached = 0;
+    if (night->references == 0) night_free(night);
+}
+
+/*
+ * Returns the cached night or decodes it, the caller has to hand it back with
+ * night_release. A cached night is only used while size and mtime of its file
+ * are unchanged, recordings may still be written while they are queried.
+ */
+static struct night *night_acquire(const char *name, cms50f_status_t *status)
+{
+    if (!is_night_name(name)) { *status = CMS50F_EINVAL; return NULL; }
+
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/%s.txt", directory, name);
+    struct stat info;
+    if (stat(filename, &info) < 0) {
+        LOG_DEBUG("file %s could not be opened: %s", filename, strerror(errno));
+        *status = CMS50F_EFILE;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i] && strcmp(cache[i]->name, name) == 0 && cache[i]->size == info.st_size && cache[i]->mtime == info.st_mtime) {
+            struct night *night = cache[i];
+            night->last_used = ++cache_clock;
+            ++night->references;
+            pthread_mutex_unlock(&cache_lock);
+            return night;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    struct night *night = calloc(1, sizeof(struct night));
+    if (!night) { *status = CMS50F_ENOMEM; return NULL; }
+
+    if ((*status = cms50f_recording_load(filename, &night->recording)) != CMS50F_SUCCESS) {
+        free(night);
+        return NULL;
+    }
+    strncpy(night->name, name, sizeof(night->name) - 1);
+    night->size = info.st_size;
+    night->mtime = info.st_mtime;
+    compute_stats(&night->recording, &night->stats);
+    night->references = 1;
+    LOG_DEBUG("night %s decoded, %u samples", name, night->recording.length);
+
+    pthread_mutex_lock(&cache_lock);
+    int slot = -1;
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i] && strcmp(cache[i]->name, name) == 0) {
+            if (cache[i]->size == night->size && cache[i]->mtime == night->mtime) {
+                /* another worker was faster */
+                struct night *cached = cache[i];
+                cached->last_used = ++cache_clock;
+                ++cached->references;
+                pthread_mutex_unlock(&cache_lock);
+                night_free(night);
+                return cached;
+            }
+            LOG_DEBUG("night %s changed on disk", name);
+            night_uncache(i);
+        }
+        if (!cache[i]) { if (slot < 0 || cache[slot]) slot = i; }
+        else if (cache[i]->references == 0 && (slot < 0 || (cache[slot] && cache[i]->last_used < cache[slot]->last_used))) slot = i;
+    }
+    if (slot >= 0) {
+        if (cache[slot]) { LOG_DEBUG("night %s evicted", cache[slot]->name); night_uncache(slot); }
+        cache[slot] = night;
+        night->cached = 1;
+        night->last_used = ++cache_clock;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return night;
+}
+
+static void night_release(struct night *night)
+{
+    pthread_mutex_lock(&cache_lock);
+    int unused = --night->references == 0 && !night->cached;
+    pthread_mutex_unlock(&cache_lock);
+    if (unused) night_free(night);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static void list_nights(FILE *out)
+{
+    DIR *dir = opendir(directory);
+    if (!dir) { fprintf(out, "error %s\n", strerror(errno)); return; }
+
+    char (*names)[SERVER_NAME_SIZE] = NULL;
+    size_t count = {0};
+    size_t capacity = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length <= 4 || length - 4 >= SERVER_NAME_SIZE || strcmp(entry->d_name + length - 4, ".txt") != 0) continue;
+
+        char name[SERVER_NAME_SIZE] = {0};
+        memcpy(name, entry->d_name, length - 4);
+        if (!is_night_name(name)) continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            void *grown = realloc(names, capacity * SERVER_NAME_SIZE);
+            if (!grown) break;
+            names = grown;
+        }
+        memcpy(names[count++], name, SERVER_NAME_SIZE);
+    }
+    closedir(dir);
+
+    qsort(names, count, SERVER_NAME_SIZE, compare_names);
+    fprintf(out, "ok %zu\n", count);
+    for (size_t i = 0; i < count; ++i) fprintf(out, "%s\n", names[i]);
+    free(names);
+}
+
+static void night_stats(FILE *out, const char *name)
+{
+    cms50f_status_t status;
+    struct night *night = night_acquire(name, &status);
+    if (!night) { fprintf(out, "error %s\n", cms50f_strerror(status)); return; }
+
+    const struct stats *stats = &night->stats;
+    unsigned valid = stats->valid ? stats->valid : 1;
+    fprintf(out, "ok 1\n");
+    fprintf(out, "start=%ld length=%u valid=%u", (long)night->recording.start, night->recording.length, stats->valid);
+    fprintf(out, " min_spo2=%u max_spo2=%u mean_spo2=%.2f", stats->min_spo2, stats->max_spo2, (double)stats->sum_spo2 / valid);
+    fprintf(out, " min_bpm=%u max_bpm=%u mean_bpm=%.2f", stats->min_bpm, stats->max_bpm, (double)stats->sum_bpm / valid);
+    for (int t = 0; t < THRESHOLD_COUNT; ++t)
+        fprintf(out, " below_%u=%u count_below_%u=%u", thresholds[t], stats->below[t], thresholds[t], stats->count_below[t]);
+    fprintf(out, "\n");
+
+    night_release(night);
+}
+
+static void night_samples(FILE *out, const char *name, long from, long to, unsigned points)
+{
+    cms50f_status_t status;
+    struct night *night = night_acquire(name, &status);
+    if (!night) { fprintf(out, "error %s\n", cms50f_strerror(status)); return; }
+
+    const cms50f_recording_t *recording = &night->recording;
+    long start = recording->start;
+    long end = start + (long)recording->length - 1;
+    if (from < start) from = start;
+    if (to > end) to = end;
+
+    unsigned long n = from <= to ? to - from + 1 : 0;
+    if (points == 0 || points > n) points = (unsigned)n;
+
+    fprintf(out, "ok %u\n", points);
+    for (unsigned long k = 0; k < points; ++k) {
+        unsigned long first = from - start + k * n / points;
+        unsigned long last = from - start + (k + 1) * n / points;
+        unsigned long sum_spo2 = 0, sum_bpm = 0;
+        unsigned valid_spo2 = 0, valid_bpm = 0;
+        for (unsigned long i = first; i < last; ++i) {
+            if (recording->spo2[i]) { sum_spo2 += recording->spo2[i]; ++valid_spo2; }
+            if (recording->bpm[i]) { sum_bpm += recording->bpm[i]; ++valid_bpm; }
+        }
+        fprintf(out, "%ld %lu %lu\n", start + (long)first,
+                valid_spo2 ? (sum_spo2 + valid_spo2 / 2) / valid_spo2 : 0,
+                valid_bpm ? (sum_bpm + valid_bpm / 2) / valid_bpm : 0);
+    }
+
+    night_release(night);
+}
+
+static void handle_request(char *line, FILE *out)
+{
+    char name[SERVER_NAME_SIZE] = {0};
+    long from, to;
+    unsigned points;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strcmp(line, "list") == 0) list_nights(out);
+    else if (sscanf(line, "stats %31s", name) == 1) night_stats(out, name);
+    else if (sscanf(line, "samples %31s %ld %ld %u", name, &from, &to, &points) == 4) night_samples(out, name, from, to, points);
+    else fprintf(out, "error unknown request\n");
+}
+
+static void connection_close(struct connection *connection)
+{
+    fclose(connection->out);
+    close(connection->fd);
+    free(connection);
+}
+
+/*
+ * Answers every complete request that arrived so far. Returns 0 when the
+ * connection should go back to the poll set and -1 when it is done.
+ */
+static int serve_requests(struct connection *connection)
+{
+    ssize_t n = recv(connection->fd, connection->request + connection->length, sizeof(connection->request) - 1 - connection->length, MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    connection->length += n;
+    connection->request[connection->length] = '\0';
+
+    char *line = connection->request;
+    char *end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        handle_request(line, connection->out);
+        line = end + 1;
+    }
+    connection->length -= line - connection->request;
+    memmove(connection->request, line, connection->length);
+
+    if (connection->length == sizeof(connection->request) - 1) {
+        fprintf(connection->out, "error request too long\n");
+        fflush(connection->out);
+        return -1;
+    }
+
+    return fflush(connection->out) == EOF ? -1 : 0;
+}
+
+static void enqueue(struct connection *connection)
+{
+    connection->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) queue_tail->next = connection; else queue_head = connection;
+    queue_tail = connection;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static struct connection *dequeue(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) pthread_cond_wait(&queue_not_empty, &queue_lock);
+    struct connection *connection = queue_head;
+    queue_head = connection->next;
+    if (!queue_head) queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    return connection;
+}
+
+/* a worker only stays with a connection for the requests that already arrived, then hands it back to the poll loop */
+static void *worker(void *arg)
+{
+    for (;;) {
+        struct connection *connection = dequeue();
+        if (serve_requests(connection) < 0 || write(idle_pipe[1], &connection, sizeof(connection)) != sizeof(connection))
+            connection_close(connection);
+    }
+    return NULL;
+}
+
+static struct connection *connection_open(int fd)
+{
+    struct connection *connection = calloc(1, sizeof(struct connection));
+    int out_fd = dup(fd);
+    FILE *out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+    if (!connection || !out) {
+        LOG_ERROR("could not serve client: %s", strerror(errno));
+        if (out) fclose(out); else if (out_fd >= 0) close(out_fd);
+        free(connection);
+        close(fd);
+        return NULL;
+    }
+    connection->fd = fd;
+    connection->out = out;
+    return connection;
+}
+
+struct poll_set {
+    struct pollfd *fds;
+    struct connection **connections;
+    size_t count;
+    size_t capacity;
+};
+
+static int poll_set_add(struct poll_set *set, int fd, struct connection *connection)
+{
+    if (set->count == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        struct pollfd *fds = realloc(set->fds, capacity * sizeof(struct pollfd));
+        if (fds) set->fds = fds;
+        struct connection **connections = realloc(set->connections, capacity * sizeof(struct connection *));
+        if (connections) set->connections = connections;
+        if (!fds || !connections) return -1;
+        set->capacity = capacity;
+    }
+    set->fds[set->count] = (struct pollfd){ fd, POLLIN, 0 };
+    set->connections[set->count] = connection;
+    ++set->count;
+    return 0;
+}
+
+static void poll_set_remove(struct poll_set *set, size_t i)
+{
+    --set->count;
+    set->fds[i] = set->fds[set->count];
+    set->connections[i] = set->connections[set->count];
+}
+
+static void poll_set_add_connection(struct poll_set *set, struct connection *connection)
+{
+    if (poll_set_add(set, connection->fd, connection) < 0) {
+        LOG_ERROR("%s", "out of memory");
+        connection_close(connection);
+    }
+}
+
+int cms50f_server_run(const char *socket_path, const char *dir)
+{
+    directory = dir;
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        LOG_ERROR("socket path too long: %s", socket_path);
+        return -1;
+    }
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    /* only a socket left behind by an earlier run may be replaced */
+    struct stat info;
+    if (lstat(socket_path, &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            LOG_ERROR("%s exists and is not a socket", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { LOG_ERROR("could not create socket: %s", strerror(errno)); return -1; }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        LOG_ERROR("could not listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (pipe(idle_pipe) < 0) {
+        LOG_ERROR("could not create pipe: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = cpus < MIN_WORKERS ? MIN_WORKERS : cpus > MAX_WORKERS ? MAX_WORKERS : (unsigned)cpus;
+    for (unsigned i = 0; i < workers; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            LOG_ERROR("could not start worker: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    printf("Serving %s on %s with %u workers\n", directory, socket_path, workers);
+    fflush(stdout);
+
+    /* idle connections wait here, a readable one is queued for the workers until they hand it back */
+    struct poll_set set = {0};
+    if (poll_set_add(&set, fd, NULL) < 0 || poll_set_add(&set, idle_pipe[0], NULL) < 0) {
+        LOG_ERROR("%s", "out of memory");
+        close(fd);
+        return -1;
+    }
+
+    for (;;) {
+        if (poll(set.fds, set.count, -1) < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        for (size_t i = set.count; i-- > 2;) {
+            if (set.fds[i].revents == 0) continue;
+            struct connection *connection = set.connections[i];
+            poll_set_remove(&set, i);
+            enqueue(connection);
+        }
+
+        if (set.fds[1].revents & POLLIN) {
+            struct connection *returned[64];
+            ssize_t n = read(idle_pipe[0], returned, sizeof(returned));
+            for (ssize_t i = 0; i < n / (ssize_t)sizeof(returned[0]); ++i) poll_set_add_connection(&set, returned[i]);
+        }
+
+        if (set.fds[0].revents & POLLIN) {
+            int client;
+            while ((client = accept(fd, NULL, NULL)) >= 0) {
+                struct connection *connection = connection_open(client);
+                if (connection) poll_set_add_connection(&set, connection);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                LOG_ERROR("accept failed: %s", strerror(errno));
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    unlink(socket_path);
+    return -1;
+}
@@ -0,0 +1,28 @@
+//
+//  server.h
+//  CMS50F_Cli
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef server_h
+#define server_h
+
+/*
+ * Query service for the recordings (YYYYMMDD_HHMMSS.txt) in a directory. The
+ * protocol is line based, every request is answered with "ok <n>" followed by
+ * n lines or with a single "error <message>" line:
+ *
+ *  list                                    names of all nights
+ *  stats <night>                           key=value statistics of one night
+ *  samples <night> <from> <to> <points>    "<timestamp> <spo2> <bpm>" lines between
+ *                                          two unix timestamps, averaged down to
+ *                                          at most <points> lines (0 keeps all)
+ */
+
+#define SERVER_NAME_SIZE            32
+
+int cms50f_server_run(const char *socket_path, const char *directory);
+int cms50f_server_benchmark(const char *socket_path, unsigned clients, unsigned requests);
+
+#endif /* server_h */
@@ -0,0 +1,376 @@
+//
+//  watch.c
+//  CMS50F_Cli
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#include "watch.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#else
+#include <fcntl.h>
+#include <sys/event.h>
+#endif
+
+#define MANIFEST                    ".cms50f_manifest"
+#define DEBOUNCE                    2.0     /* seconds without change before a recording counts as complete */
+#define MAX_WORKERS                 8
+#define MAX_ATTEMPTS                5       /* failed conversions are retried after 4, 8, 16 and 32 seconds */
+#define REAP_INTERVAL               250     /* ms between looking for finished workers */
+#define NAME_SIZE                   32
+
+struct entry {
+    char name[NAME_SIZE];
+    long long size;
+    long long mtime;
+    uint64_t hash;
+    double deadline;
+    double started;
+    pid_t pid;
+    unsigned attempts;
+};
+
+struct list {
+    struct entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+static struct list manifest = {0};
+static struct list pending = {0};
+static struct list running = {0};
+static struct list given_up = {0};      /* failed MAX_ATTEMPTS times, skipped until size or mtime change */
+static watch_handler_t handler = {0};
+static unsigned workers = {0};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct entry *list_find(struct list *list, const char *name)
+{
+    for (size_t i = 0; i < list->count; ++i)
+        if (strcmp(list->entries[i].name, name) == 0) return &list->entries[i];
+    return NULL;
+}
+
+static struct entry *list_put(struct list *list, const struct entry *entry)
+{
+    struct entry *found = list_find(list, entry->name);
+    if (!found) {
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 32;
+            struct entry *entries = realloc(list->entries, capacity * sizeof(struct entry));
+            if (!entries) return NULL;
+            list->entries = entries;
+            list->capacity = capacity;
+        }
+        found = &list->entries[list->count++];
+    }
+    *found = *entry;
+    return found;
+}
+
+static void list_remove(struct list *list, struct entry *entry)
+{
+    *entry = list->entries[--list->count];
+}
+
+static int is_recording_name(const char *name)
+{
+    static const char pattern[] = "DDDDDDDD_DDDDDD.txt";
+    if (strlen(name) != strlen(pattern)) return 0;
+    for (size_t i = 0; pattern[i]; ++i) {
+        if (pattern[i] == 'D' ? (name[i] < '0' || name[i] > '9') : name[i] != pattern[i]) return 0;
+    }
+    return 1;
+}
+
+/* FNV-1a over the whole file */
+static int hash_file(const char *name, uint64_t *hash)
+{
+    FILE *in = {0};
+    if ((in = fopen(name, "r")) == NULL) return -1;
+
+    unsigned char buffer[1 << 16];
+    size_t n;
+    *hash = 0xcbf29ce484222325ULL;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        for (size_t i = 0; i < n; ++i) *hash = (*hash ^ buffer[i]) * 0x100000001b3ULL;
+    }
+    int failed = ferror(in);
+    fclose(in);
+
+    return failed ? -1 : 0;
+}
+
+static void manifest_load(void)
+{
+    FILE *in = {0};
+    if ((in = fopen(MANIFEST, "r")) == NULL) return;
+
+    struct entry entry = {0};
+    while (fscanf(in, "%31s %lld %lld %" SCNx64, entry.name, &entry.size, &entry.mtime, &entry.hash) == 4) list_put(&manifest, &entry);
+    fclose(in);
+}
+
+static void manifest_add(const struct entry *entry)
+{
+    list_put(&manifest, entry);
+
+    FILE *out = {0};
+    if ((out = fopen(MANIFEST, "a")) == NULL) {
+        LOG_ERROR("could not open file: %s", MANIFEST);
+        return;
+    }
+    fprintf(out, "%s %lld %lld %016" PRIx64 "\n", entry->name, entry->size, entry->mtime, entry->hash);
+    if (fclose(out) == EOF) LOG_ERROR("could not close file: %s", strerror(errno));
+}
+
+static int unchanged(const struct entry *entry, const struct stat *info)
+{
+    return entry && entry->size == info->st_size && entry->mtime == info->st_mtime;
+}
+
+/*
+ * Called for every file that was created or changed. Files that are processed,
+ * queued, running or given up are recognized by size and mtime, so their
+ * attempts and backoff survive events for other files.
+ */
+static void mark(const char *name)
+{
+    if (!is_recording_name(name)) return;
+
+    struct stat info;
+    if (stat(name, &info) < 0) return;
+
+    if (unchanged(list_find(&manifest, name), &info)) return;
+    if (unchanged(list_find(&pending, name), &info)) return;
+    if (unchanged(list_find(&running, name), &info)) return;
+
+    struct entry *failed = list_find(&given_up, name);
+    if (unchanged(failed, &info)) return;
+    if (failed) list_remove(&given_up, failed);
+
+    struct entry entry = { .size = info.st_size, .mtime = info.st_mtime, .deadline = now() + DEBOUNCE };
+    strncpy(entry.name, name, sizeof(entry.name) - 1);
+    if (!list_put(&pending, &entry)) LOG_ERROR("%s", "out of memory");
+    LOG_DEBUG("%s changed", name);
+}
+
+static void scan(void)
+{
+    DIR *dir = opendir(".");
+    if (!dir) { LOG_ERROR("could not read directory: %s", strerror(errno)); return; }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) mark(entry->d_name);
+    closedir(dir);
+}
+
+static void dispatch(struct entry *entry)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERROR("could not start worker: %s", strerror(errno));
+        entry->deadline = now() + DEBOUNCE;
+        return;
+    }
+    if (pid == 0) exit(handler(entry->name) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    printf("Processing %s\n", entry->name);
+    entry->pid = pid;
+    entry->started = now();
+    list_put(&running, entry);
+    list_remove(&pending, entry);
+}
+
+/* a recording is handed to a worker once it stopped changing, unless its content was processed before */
+static void check_pending(void)
+{
+    double time = now();
+    for (size_t i = pending.count; i-- > 0;) {
+        struct entry *entry = &pending.entries[i];
+        if (entry->deadline > time || running.count >= workers) continue;
+
+        struct stat info;
+        if (stat(entry->name, &info) < 0) { list_remove(&pending, entry); continue; }
+        if (!unchanged(entry, &info) || list_find(&running, entry->name)) {
+            if (!unchanged(entry, &info)) entry->attempts = 0;
+            entry->size = info.st_size;
+            entry->mtime = info.st_mtime;
+            entry->deadline = time + DEBOUNCE;
+            continue;
+        }
+
+        if (hash_file(entry->name, &entry->hash) < 0) { list_remove(&pending, entry); continue; }
+        struct entry *known = list_find(&manifest, entry->name);
+        if (known && known->hash == entry->hash) {
+            LOG_DEBUG("%s is unchanged", entry->name);
+            manifest_add(entry);
+            list_remove(&pending, entry);
+            continue;
+        }
+
+        dispatch(entry);
+    }
+}
+
+static void reap(void)
+{
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < running.count; ++i) {
+            struct entry *entry = &running.entries[i];
+            if (entry->pid != pid) continue;
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+                printf("Done %s in %.1f s\n", entry->name, now() - entry->started);
+                manifest_add(entry);
+            } else if (list_find(&pending, entry->name)) {
+                LOG_ERROR("processing %s failed, it changed in the meantime", entry->name);
+            } else if (++entry->attempts < MAX_ATTEMPTS) {
+                LOG_ERROR("processing %s failed, attempt %u of %u", entry->name, entry->attempts, MAX_ATTEMPTS);
+                entry->deadline = now() + DEBOUNCE * (1u << entry->attempts);
+                if (!list_put(&pending, entry)) LOG_ERROR("%s", "out of memory");
+            } else {
+                LOG_ERROR("processing %s failed %u times, giving up until it changes", entry->name, entry->attempts);
+                if (!list_put(&given_up, entry)) LOG_ERROR("%s", "out of memory");
+            }
+            list_remove(&running, entry);
+            break;
+        }
+    }
+}
+
+/* sleeps without a timeout while there is nothing to do */
+static int next_timeout(void)
+{
+    int timeout = -1;
+    double time = now();
+    for (size_t i = 0; i < pending.count; ++i) {
+        double remaining = pending.entries[i].deadline - time;
+        int ms = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+        if (ms == 0 && running.count >= workers) ms = REAP_INTERVAL;
+        if (timeout < 0 || ms < timeout) timeout = ms;
+    }
+    if (running.count > 0 && (timeout < 0 || timeout > REAP_INTERVAL)) timeout = REAP_INTERVAL;
+    return timeout;
+}
+
+#ifdef __linux__
+static int watch_open(void)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return -1;
+    if (inotify_add_watch(fd, ".", IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void watch_wait(int fd, int timeout)
+{
+    struct pollfd descriptor = { fd, POLLIN, 0 };
+    if (poll(&descriptor, 1, timeout) <= 0) return;
+
+    _Alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        const struct inotify_event *event;
+        for (char *cursor = buffer; cursor < buffer + length; cursor += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)cursor;
+            if (event->len > 0) mark(event->name);
+        }
+    }
+}
+#else
+/* the watched directory has to stay open as long as the kqueue watches it */
+static int directory_fd = -1;
+
+/* kqueue only reports that the directory changed, a rescan finds out what */
+static int watch_open(void)
+{
+    int kq = kqueue();
+    int dir = open(".", O_RDONLY | O_CLOEXEC);
+    if (kq < 0 || dir < 0) {
+        int error = errno;
+        if (kq >= 0) close(kq);
+        if (dir >= 0) close(dir);
+        errno = error;
+        return -1;
+    }
+
+    struct kevent change;
+    EV_SET(&change, dir, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND, 0, NULL);
+    if (kevent(kq, &change, 1, NULL, 0, NULL) < 0) {
+        int error = errno;
+        close(kq);
+        close(dir);
+        errno = error;
+        return -1;
+    }
+    directory_fd = dir;
+    return kq;
+}
+
+static void watch_wait(int kq, int timeout)
+{
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+    struct kevent event;
+    if (kevent(kq, NULL, 0, &event, 1, timeout < 0 ? NULL : &ts) > 0) scan();
+}
+#endif
+
+int cms50f_watch_run(const char *directory, watch_handler_t watch_handler)
+{
+    if (chdir(directory) < 0) {
+        LOG_ERROR("could not change to %s: %s", directory, strerror(errno));
+        return -1;
+    }
+    handler = watch_handler;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (unsigned)cpus;
+
+    int fd = watch_open();
+    if (fd < 0) {
+        LOG_ERROR("could not watch %s: %s", directory, strerror(errno));
+        return -1;
+    }
+
+    manifest_load();
+    scan();
+    printf("Watching %s with %u workers\n", directory, workers);
+
+    for (;;) {
+        fflush(stdout);
+        watch_wait(fd, next_timeout());
+        reap();
+        check_pending();
+    }
+
+    return -1;
+}
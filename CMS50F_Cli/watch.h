@@ -0,0 +1,23 @@
+//
+//  watch.h
+//  CMS50F_Cli
+//
+//  Created by Oliver Epper on 19.10.26.
+//
+
+#ifndef watch_h
+#define watch_h
+
+typedef int(*watch_handler_t)(const char *filename);
+
+/*
+ * Changes into directory and runs handler for every recording
+ * (YYYYMMDD_HHMMSS.txt) that is already there or shows up later, once it did
+ * not change for a few seconds. Each recording is handled in a forked worker
+ * so the handler may keep per night state in statics. Handled recordings are
+ * listed with size, mtime and content hash in .cms50f_manifest and skipped
+ * from then on. Only returns on error.
+ */
+int cms50f_watch_run(const char *directory, watch_handler_t handler);
+
+#endif /* watch_h */